@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include "xssh.h"
+
+// Everything handed out is aligned to this
+#define ARENA_ALIGN 16
+
+// Memory that didn't fit in the main block, freed on the next reset
+struct arenaBlock {
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+};
+
+// Data in an overflow block starts after its (aligned) header
+#define BLOCK_HEADER ((sizeof(struct arenaBlock) + ARENA_ALIGN - 1) \
+        & ~(size_t) (ARENA_ALIGN - 1))
+
+
+
+/*
+ * Sets up an arena with a main block of size bytes.
+ */
+void initArena(struct arena *arena, size_t size) {
+    arena->base = (char *) malloc(size);
+    arena->size = size;
+    arena->used = 0;
+    arena->last = NULL;
+    arena->extra = NULL;
+    arena->extraUsed = 0;
+    arena->highWater = 0;
+    arena->resets = 0;
+    arena->overflows = 0;
+}
+
+
+
+/*
+ * Frees the main block and any overflow blocks.
+ */
+void freeArena(struct arena *arena) {
+    struct arenaBlock *block = arena->extra;
+
+    while(block != NULL) {
+        struct arenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->last = NULL;
+    arena->extra = NULL;
+    arena->extraUsed = 0;
+}
+
+
+
+/*
+ * Hands out size bytes. Comes from the main block when it fits, from
+ * overflow blocks malloc'd on the side when it doesn't.
+ */
+void *arenaAlloc(struct arena *arena, size_t size) {
+    size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    struct arenaBlock *block;
+
+    if(arena->used + aligned <= arena->size) {
+        arena->last = arena->base + arena->used;
+        arena->used += aligned;
+        return arena->last;
+    }
+
+    // Main block is full, remember how much we needed so reset can grow it
+    arena->extraUsed += aligned;
+    arena->last = NULL;
+
+    block = arena->extra;
+    if(block != NULL && block->used + aligned <= block->size) {
+        block->used += aligned;
+        return (char *) block + BLOCK_HEADER + block->used - aligned;
+    }
+
+    // Overflow blocks are at least as big as the main block
+    block = (struct arenaBlock *) malloc(BLOCK_HEADER
+            + (aligned > arena->size ? aligned : arena->size));
+    block->next = arena->extra;
+    block->size = (aligned > arena->size ? aligned : arena->size);
+    block->used = aligned;
+    arena->extra = block;
+    ++arena->overflows;
+
+    return (char *) block + BLOCK_HEADER;
+}
+
+
+
+/*
+ * Resizes an allocation from this arena. When ptr is the most recent
+ * allocation in the main block it grows in place, otherwise the data
+ * is copied into a new allocation.
+ */
+void *arenaGrow(struct arena *arena, void *ptr, size_t oldSize,
+        size_t newSize) {
+    void *grown;
+
+    if(ptr != NULL && ptr == arena->last) {
+        size_t start = (char *) ptr - arena->base;
+        size_t aligned = (newSize + ARENA_ALIGN - 1)
+                & ~(size_t) (ARENA_ALIGN - 1);
+
+        if(start + aligned <= arena->size) {
+            arena->used = start + aligned;
+            return ptr;
+        }
+    }
+
+    grown = arenaAlloc(arena, newSize);
+    if(ptr != NULL) {
+        memcpy(grown, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+
+    return grown;
+}
+
+
+
+/*
+ * Copies a string into the arena
+ */
+char *arenaStrdup(struct arena *arena, const char *str) {
+    size_t length = strlen(str) + 1;
+    char *copy = (char *) arenaAlloc(arena, length);
+
+    memcpy(copy, str, length);
+    return copy;
+}
+
+
+
+/*
+ * Throws away everything allocated since the last reset.
+ * If the last round needed overflow blocks, the main block is grown
+ * to the high-water mark so the next round fits without them.
+ */
+void resetArena(struct arena *arena) {
+    size_t total = arena->used + arena->extraUsed;
+    struct arenaBlock *block = arena->extra;
+
+    if(total > arena->highWater) {
+        arena->highWater = total;
+    }
+
+    while(block != NULL) {
+        struct arenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    if(arena->extraUsed > 0) {
+        size_t size = arena->size;
+
+        while(size < arena->highWater) {
+            size *= 2;
+        }
+
+        free(arena->base);
+        arena->base = (char *) malloc(size);
+        arena->size = size;
+    }
+
+    arena->used = 0;
+    arena->last = NULL;
+    arena->extra = NULL;
+    arena->extraUsed = 0;
+    ++arena->resets;
+}
@@ -0,0 +1,368 @@
+/*
+ * Microbenchmarks for the shell's hot paths, linked against xssh.c
+ * built with XSSH_NO_MAIN. Prints one JSON object of ns per call.
+ * Run through make bench.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../xssh.h"
+
+extern char **environ;
+
+// Variables, arena and such everything below runs in
+static struct interpreter shell;
+
+// Table sizes the variable lookups are timed at
+static const int tableSizes[] = {10, 1000, 100000};
+#define NUM_TABLE_SIZES (sizeof(tableSizes) / sizeof(tableSizes[0]))
+
+// Names looked up, spread over the whole table
+#define NUM_LOOKUPS 1024
+
+// Lines the tokenizers are timed on, a typical one and one with long
+// arguments
+static struct {
+    const char *name;
+    const char *text;
+} tokenizeLines[] = {
+    {"typical", "grep -n pattern $file > out.txt # comment"},
+    {"long", "cc -O2 -Wall -Wextra -I/usr/local/include/some/library "
+        "-I/home/someone/projects/a-rather-long-project-name/include "
+        "-DSOME_CONFIGURATION_OPTION=enabled -o build/objects/module.o "
+        "-c src/subsystem/another_directory/a_long_source_file_name.c "
+        "$(cat build/flags/extra_flags_for_this_particular_target.txt) "
+        "-L/usr/local/lib/some/library/with/a/long/install/path/lib64"},
+};
+#define NUM_TOKENIZE_LINES (sizeof(tokenizeLines) / sizeof(tokenizeLines[0]))
+
+// Named like enum tokenizerKind
+static const char *tokenizerNames[] = {"scalar", "sse2", "avx2"};
+#define NUM_TOKENIZERS (sizeof(tokenizerNames) / sizeof(tokenizerNames[0]))
+
+// Keeps the compiler from dropping work whose result isn't used
+static volatile unsigned long sink;
+
+
+
+/*
+ * Nanoseconds on the monotonic clock
+ */
+static double now() {
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+
+
+/*
+ * splitCommand on a typical line. The line is cut up in place, so
+ * it's copied back in each time, that copy is timed too.
+ */
+static double benchSplit(long iterations) {
+    const char *text = "grep -n pattern $file > out.txt # comment";
+    char line[128];
+    char *args[MAX_LINE_WORDS + 1];
+    int count;
+    double start = now();
+    long i;
+
+    for(i = 0; i < iterations; ++i) {
+        strcpy(line, text);
+        count = 1;
+        splitCommand(line, args, &count);
+        sink += count;
+    }
+
+    return (now() - start) / iterations;
+}
+
+
+
+/*
+ * splitCommand as it was before tokenizeLine, strtok_r style with the
+ * # and $( ) handling on top, to compare the tokenizer against
+ */
+static char *referenceWord(char *line, const char *delim, char **rest) {
+    char *start = (line != NULL ? line : *rest);
+    char *end;
+    int depth = 0;
+
+    start += strspn(start, delim);
+    if(*start == 0) {
+        *rest = start;
+        return NULL;
+    }
+
+    for(end = start; *end != 0; ++end) {
+        if(end[0] == '$' && end[1] == '(') {
+            ++depth;
+            ++end;
+        } else if(*end == ')' && depth > 0) {
+            --depth;
+        } else if(depth == 0 && strchr(delim, *end) != NULL) {
+            break;
+        }
+    }
+
+    if(*end != 0) {
+        *end++ = 0;
+    }
+    *rest = end;
+
+    return start;
+}
+
+static char *referenceComment(char *word) {
+    int depth = 0;
+
+    for(; *word != 0; ++word) {
+        if(word[0] == '$' && word[1] == '(') {
+            ++depth;
+            ++word;
+        } else if(*word == ')' && depth > 0) {
+            --depth;
+        } else if(*word == '#' && depth == 0) {
+            return word;
+        }
+    }
+
+    return NULL;
+}
+
+static void referenceSplit(char *line, char **argBuffer, int *argCount) {
+    const char *delim = " \t\n";
+    char *word, *rest, *commented;
+
+    if(line[0] == '#'
+            || (word = referenceWord(line, delim, &rest)) == NULL) {
+        *argCount = 0;
+        argBuffer[0] = 0;
+        return;
+    }
+
+    if((commented = referenceComment(word)) != NULL) {
+        *commented = 0;
+    }
+    argBuffer[0] = word;
+
+    while(commented == NULL && *argCount < MAX_LINE_WORDS
+            && (word = referenceWord(NULL, delim, &rest)) != NULL
+            && word[0] != '#') {
+        if((commented = referenceComment(word)) != NULL) {
+            *commented = 0;
+        }
+        argBuffer[(*argCount)++] = word;
+    }
+
+    argBuffer[*argCount] = 0;
+}
+
+
+
+/*
+ * Megabytes per second split into words, through splitCommand with
+ * the given kind of tokenizer, or through referenceSplit for kind -1.
+ * -1 if this CPU can't run kind.
+ */
+static double benchTokenize(int kind, const char *text, long iterations) {
+    size_t length = strlen(text);
+    char *line = (char *) malloc(length + 1);
+    char *args[MAX_LINE_WORDS + 1];
+    int count;
+    double start;
+    long i;
+
+    if(kind != -1 && useTokenizer(kind) == -1) {
+        free(line);
+        return -1;
+    }
+
+    start = now();
+    for(i = 0; i < iterations; ++i) {
+        memcpy(line, text, length + 1);
+        count = 1;
+        if(kind == -1) {
+            referenceSplit(line, args, &count);
+        } else {
+            splitCommand(line, args, &count);
+        }
+        sink += count;
+    }
+    start = now() - start;
+
+    free(line);
+    return length * (double) iterations / start * 1e3;
+}
+
+
+
+/*
+ * Fills the local variables with v0 .. v(size-1)
+ */
+static void fillVars(int size) {
+    char id[32];
+    int i;
+
+    freeVarTable(&shell.localVars);
+    initVarTable(&shell.localVars, &shell.names);
+
+    for(i = 0; i < size; ++i) {
+        sprintf(id, "v%d", i);
+        setLocalVar(&shell, id, "value");
+    }
+}
+
+
+
+/*
+ * findLocalVar for names all over a table of size variables
+ */
+static double benchFind(int size, long iterations) {
+    static char ids[NUM_LOOKUPS][32];
+    double start;
+    long i;
+
+    for(i = 0; i < NUM_LOOKUPS; ++i) {
+        sprintf(ids[i], "v%ld", (i * 7919) % size);
+    }
+
+    start = now();
+    for(i = 0; i < iterations; ++i) {
+        sink += (unsigned long) findLocalVar(&shell, ids[i % NUM_LOOKUPS]);
+    }
+
+    return (now() - start) / iterations;
+}
+
+
+
+/*
+ * subVar on a four word command, two of them variables, with size
+ * variables set. The arena is reset like after each command.
+ */
+static double benchSubVar(int size, long iterations) {
+    char id[32];
+    struct word words[4];
+    char *args[5];
+    double start;
+    long i;
+
+    sprintf(id, "$v%d", size / 2);
+    words[0].text = "cp";
+    words[0].isVar = 0;
+    words[1].text = id;
+    words[1].isVar = 1;
+    words[2].text = "$v0";
+    words[2].isVar = 1;
+    words[3].text = "dest";
+    words[3].isVar = 0;
+
+    start = now();
+    for(i = 0; i < iterations; ++i) {
+        subVar(&shell, words, 4, args);
+        sink += (unsigned long) args[1];
+        freeArgBuffer(&shell);
+    }
+
+    return (now() - start) / iterations;
+}
+
+
+
+/*
+ * Name to opcode lookup for a builtin near the end of the table,
+ * and a name that isn't a builtin at all
+ */
+static double benchLookup(long iterations) {
+    double start = now();
+    long i;
+
+    for(i = 0; i < iterations; ++i) {
+        sink += lookupBuiltin(i & 1 ? "wait" : "grep");
+    }
+
+    return (now() - start) / iterations;
+}
+
+
+
+/*
+ * A parsed "set a $b" going through runCommand, expansion included
+ */
+static double benchDispatch(long iterations) {
+    struct arena arena;
+    struct command *command;
+    char line[] = "set a $b";
+    double start;
+    long i;
+
+    initArena(&arena, 4096);
+    command = parseLine(&arena, line, 1);
+    setLocalVar(&shell, "b", "value");
+
+    start = now();
+    for(i = 0; i < iterations; ++i) {
+        runCommand(&shell, command);
+        freeArgBuffer(&shell);
+    }
+
+    start = (now() - start) / iterations;
+    freeArena(&arena);
+
+    return start;
+}
+
+
+
+int main(int argc, char *argv[]) {
+    long iterations = (argc > 1 ? atol(argv[1]) : 1000000);
+    unsigned int i;
+    int kind, tokenizer;
+
+    logLevel = LOG_NONE;
+    initInterpreter(&shell, environ, 0);
+
+    printf("{\n");
+    printf("  \"iterations\": %ld,\n", iterations);
+    printf("  \"splitCommand_ns\": %.1f,\n", benchSplit(iterations));
+
+    tokenizer = currentTokenizer();
+    for(i = 0; i < NUM_TOKENIZE_LINES; ++i) {
+        printf("  \"tokenize_%s_reference_MBps\": %.1f,\n",
+                tokenizeLines[i].name,
+                benchTokenize(-1, tokenizeLines[i].text, iterations / 10));
+        for(kind = 0; kind < NUM_TOKENIZERS; ++kind) {
+            double rate = benchTokenize(kind, tokenizeLines[i].text,
+                    iterations / 10);
+
+            // Not on this CPU
+            if(rate < 0) {
+                continue;
+            }
+            printf("  \"tokenize_%s_%s_MBps\": %.1f,\n",
+                    tokenizeLines[i].name, tokenizerNames[kind], rate);
+        }
+    }
+    useTokenizer(tokenizer);
+
+    printf("  \"lookupBuiltin_ns\": %.1f,\n", benchLookup(iterations));
+    printf("  \"dispatch_set_ns\": %.1f,\n", benchDispatch(iterations));
+
+    for(i = 0; i < NUM_TABLE_SIZES; ++i) {
+        fillVars(tableSizes[i]);
+        printf("  \"findLocalVar_%d_ns\": %.1f,\n", tableSizes[i],
+                benchFind(tableSizes[i], iterations));
+        printf("  \"subVar_%d_ns\": %.1f%s\n", tableSizes[i],
+                benchSubVar(tableSizes[i], iterations),
+                i + 1 < NUM_TABLE_SIZES ? "," : "");
+    }
+
+    printf("}\n");
+
+    freeInterpreter(&shell);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Runs the benchmarks and prints the results as one JSON object:
+# the microbenchmarks from bench/micro, then whole -f scripts run
+# through xssh (builtins/sec, /bin/true spawns/sec for each spawn
+# method, and redirected commands/sec).
+# Usage: bench/run.sh [path to xssh] [path to micro] [number of commands]
+#
+
+XSSH=${1:-./xssh}
+MICRO=${2:-bench/micro}
+COUNT=${3:-5000}
+DIR=$(mktemp -d)
+
+trap 'rm -rf "$DIR"' EXIT
+
+# Writes a script running the given line COUNT times, then exit 0
+makeScript() {
+    awk -v n=$COUNT -v line="$2" \
+        'BEGIN { for(i = 0; i < n; ++i) print line; print "exit 0" }' > "$1"
+}
+
+# Runs xssh on a script, prints commands/sec
+timeScript() {
+    script=$1
+    shift
+
+    start=$(date +%s.%N)
+    "$XSSH" -d 0 "$@" -f "$script" > /dev/null
+    end=$(date +%s.%N)
+
+    echo "$start $end" | awk -v n=$COUNT '{ printf "%.1f", n / ($2 - $1) }'
+}
+
+makeScript "$DIR/builtin.txt" 'set name value'
+makeScript "$DIR/spawn.txt" '/bin/true'
+: > "$DIR/in.txt"
+makeScript "$DIR/redirect.txt" "/bin/true < $DIR/in.txt > $DIR/out.txt"
+
+echo "{"
+printf '  "micro": '
+"$MICRO" | sed '2,$s/^/  /; $s/$/,/'
+echo '  "scripts": {'
+echo "    \"commands\": $COUNT,"
+echo "    \"builtin_per_sec\": $(timeScript "$DIR/builtin.txt"),"
+
+for mode in fork vfork spawn zygote; do
+    echo "    \"spawn_${mode}_per_sec\": $(timeScript "$DIR/spawn.txt" -s $mode),"
+done
+
+echo "    \"redirect_per_sec\": $(timeScript "$DIR/redirect.txt")"
+echo "  }"
+echo "}"
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Measures external commands/sec for each xssh spawn method.
+# Usage: bench/spawn.sh [path to xssh] [number of commands]
+#
+
+XSSH=${1:-./xssh}
+COUNT=${2:-2000}
+SCRIPT=$(mktemp)
+
+trap 'rm -f "$SCRIPT"' EXIT
+
+i=0
+while [ $i -lt $COUNT ]; do
+    echo "/bin/true" >> "$SCRIPT"
+    i=$((i + 1))
+done
+echo "exit 0" >> "$SCRIPT"
+
+for mode in fork vfork spawn zygote; do
+    start=$(date +%s.%N)
+    "$XSSH" -d 0 -s $mode -f "$SCRIPT" > /dev/null
+    end=$(date +%s.%N)
+
+    echo "$mode $start $end" | awk -v n=$COUNT \
+        '{ printf "%-6s %8d commands %8.3f s %10.1f commands/sec\n",
+                  $1, n, $3 - $2, n / ($3 - $2) }'
+done
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include "xssh.h"
+
+// envp starts with room for this many entries, doubles after that
+#define ENV_MIN_CAPACITY 64
+
+extern char **environ;
+
+
+
+/*
+ * Makes room for one more entry and its NULL
+ */
+static void growEnv(struct environment *env) {
+    if(env->count + 2 <= env->capacity) {
+        return;
+    }
+
+    env->capacity = (env->capacity == 0 ? ENV_MIN_CAPACITY
+            : env->capacity * 2);
+    env->entries = (char **) realloc(env->entries,
+            sizeof(char *) * env->capacity);
+
+    // libc's getenv sees the same variables the children do
+    if(env->isEnviron) {
+        environ = env->entries;
+    }
+}
+
+
+
+/*
+ * Builds the NAME=VALUE string for an entry
+ */
+static char *envEntry(const char *id, const char *value) {
+    size_t idLength = strlen(id);
+    size_t valueLength = strlen(value);
+    char *entry = (char *) malloc(idLength + valueLength + 2);
+
+    memcpy(entry, id, idLength);
+    entry[idLength] = '=';
+    memcpy(entry + idLength + 1, value, valueLength + 1);
+
+    return entry;
+}
+
+
+
+/*
+ * Sets an exported variable. Only its own entry changes.
+ * Returns -1 for a name the environment can't hold.
+ */
+int exportVar(struct environment *env, const char *id, const char *value) {
+    struct variableHashStruct *var;
+
+    if(id[0] == 0 || strchr(id, '=') != NULL) {
+        return -1;
+    }
+
+    var = findVar(&env->vars, id);
+    if(var == NULL) {
+        growEnv(env);
+        var = setVar(&env->vars, id, "");
+        var->envIndex = env->count++;
+        env->entries[env->count] = NULL;
+    } else {
+        free(env->entries[var->envIndex]);
+    }
+
+    env->entries[var->envIndex] = envEntry(id, value);
+    return 0;
+}
+
+
+
+/*
+ * Takes a variable out of the environment. The last entry moves into
+ * its place, nothing else is touched. Returns -1 if it wasn't exported.
+ */
+int unexportVar(struct environment *env, const char *id) {
+    struct variableHashStruct *var = findVar(&env->vars, id);
+    int index;
+
+    if(var == NULL) {
+        return -1;
+    }
+
+    index = var->envIndex;
+    free(env->entries[index]);
+
+    if(index != --env->count) {
+        char *last = env->entries[env->count];
+        char *equals = strchr(last, '=');
+        struct variableHashStruct *moved;
+
+        // The table is keyed by name, cut the entry at = to look it up
+        *equals = 0;
+        moved = findVar(&env->vars, last);
+        *equals = '=';
+
+        moved->envIndex = index;
+        env->entries[index] = last;
+    }
+
+    env->entries[env->count] = NULL;
+    removeVar(&env->vars, id);
+
+    return 0;
+}
+
+
+
+/*
+ * The value of an exported variable, NULL if it isn't exported
+ */
+char *findEnvVar(struct environment *env, const char *id) {
+    struct variableHashStruct *var = findVar(&env->vars, id);
+
+    if(var == NULL) {
+        return NULL;
+    }
+
+    return env->entries[var->envIndex] + strlen(var->id) + 1;
+}
+
+
+
+/*
+ * Starts an environment off as a copy of from, its names interned in
+ * names. The shell's own one takes over environ, a -P script gets a
+ * copy of the shell's.
+ */
+void initEnv(struct environment *env, char **from, int isEnviron,
+        struct nameSet *names) {
+    char **entry;
+
+    memset(env, 0, sizeof(struct environment));
+    env->isEnviron = isEnviron;
+    initVarTable(&env->vars, names);
+    growEnv(env);
+    env->entries[0] = NULL;
+
+    for(entry = from; *entry != NULL; ++entry) {
+        char *equals = strchr(*entry, '=');
+        char *id;
+
+        if(equals == NULL) {
+            continue;
+        }
+
+        id = strndup(*entry, equals - *entry);
+        exportVar(env, id, equals + 1);
+        free(id);
+    }
+}
+
+
+
+/*
+ * Frees the environment, right before exiting
+ */
+void freeEnv(struct environment *env) {
+    int i;
+
+    for(i = 0; i < env->count; ++i) {
+        free(env->entries[i]);
+    }
+
+    freeVarTable(&env->vars);
+    free(env->entries);
+    if(env->isEnviron) {
+        environ = NULL;
+    }
+    memset(env, 0, sizeof(struct environment));
+}
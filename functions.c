@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <string.h>
+#include "xssh.h"
+
+
+
+/*
+ * Hash of a function name, for its bucket
+ */
+static unsigned int hashFunctionName(const char *name) {
+    unsigned int hash = 2166136261u;
+
+    while(*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash & (FUNCTION_TABLE_SIZE - 1);
+}
+
+
+
+/*
+ * Defines name as body, or redefines it. program holds the body and is
+ * kept until the function is redefined or the interpreter goes.
+ */
+void defineFunction(struct interpreter *shell, char *name,
+        struct command *body, struct program *program) {
+    struct function **bucket = &shell->functions[hashFunctionName(name)];
+    struct function *function;
+
+    for(function = *bucket; function != NULL; function = function->next) {
+        if(strcmp(function->name, name) == 0) {
+            break;
+        }
+    }
+
+    // The new one first, it may be in the same program as the old one
+    retainProgram(program);
+
+    if(function == NULL) {
+        function = (struct function *) malloc(sizeof(struct function));
+        function->name = strdup(name);
+        function->next = *bucket;
+        *bucket = function;
+        ++shell->numFunctions;
+    } else {
+        freeProgram(function->program);
+    }
+
+    function->body = body;
+    function->program = program;
+}
+
+
+
+/*
+ * The function called name, NULL if there is none
+ */
+struct function *findFunction(struct interpreter *shell, char *name) {
+    struct function *function;
+
+    if(shell->numFunctions == 0) {
+        return NULL;
+    }
+
+    function = shell->functions[hashFunctionName(name)];
+    for(; function != NULL; function = function->next) {
+        if(strcmp(function->name, name) == 0) {
+            return function;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Forgets every function, and lets go of their programs
+ */
+void freeFunctions(struct interpreter *shell) {
+    int i;
+
+    for(i = 0; i < FUNCTION_TABLE_SIZE; ++i) {
+        struct function *function = shell->functions[i];
+
+        while(function != NULL) {
+            struct function *next = function->next;
+
+            freeProgram(function->program);
+            free(function->name);
+            free(function);
+            function = next;
+        }
+
+        shell->functions[i] = NULL;
+    }
+
+    shell->numFunctions = 0;
+}
@@ -0,0 +1,833 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "xssh.h"
+
+// Starting number of buckets in the pid table, a power of two
+#define PID_TABLE_SIZE 64
+
+// How often a table without pidfds checks on its children, in ms
+#define REAP_POLL_INTERVAL 5
+
+// SIGCHLD and SIGINT are read from here instead of being handled
+static int signalFd = -1;
+
+
+
+/*
+ * Spreads pids over the buckets, they tend to come in runs
+ */
+static unsigned int hashPid(struct jobTable *jobs, pid_t pid) {
+    return ((unsigned int) pid * 2654435761u) & (jobs->pidCapacity - 1);
+}
+
+
+
+/*
+ * Doubles the pid table and moves every stage into its new bucket
+ */
+static void growPidTable(struct jobTable *jobs) {
+    struct jobProcess **oldTable = jobs->pidTable;
+    unsigned int oldCapacity = jobs->pidCapacity;
+    unsigned int i;
+
+    jobs->pidCapacity = (oldCapacity == 0 ? PID_TABLE_SIZE
+            : oldCapacity * 2);
+    jobs->pidTable = (struct jobProcess **) calloc(jobs->pidCapacity,
+            sizeof(struct jobProcess *));
+
+    for(i = 0; i < oldCapacity; ++i) {
+        struct jobProcess *process = oldTable[i];
+
+        while(process != NULL) {
+            struct jobProcess *next = process->hashNext;
+            unsigned int bucket = hashPid(jobs, process->pid);
+
+            process->hashNext = jobs->pidTable[bucket];
+            jobs->pidTable[bucket] = process;
+            process = next;
+        }
+    }
+
+    free(oldTable);
+}
+
+
+
+/*
+ * Puts a running stage into the pid table. A table that reaps by pid
+ * gets a pidfd for it too, to sleep on until it exits.
+ */
+static void hashProcess(struct jobTable *jobs, struct jobProcess *process) {
+    unsigned int bucket;
+
+    if(jobs->pidCount >= jobs->pidCapacity) {
+        growPidTable(jobs);
+    }
+
+    bucket = hashPid(jobs, process->pid);
+    process->hashNext = jobs->pidTable[bucket];
+    jobs->pidTable[bucket] = process;
+    ++jobs->pidCount;
+
+    process->pidFd = -1;
+    if(!jobs->byPid) {
+        return;
+    }
+
+    process->pidFd = (int) syscall(SYS_pidfd_open, process->pid, 0);
+
+    // Kept up to date here, so waiting doesn't go through the table
+    if(jobs->pollCount == jobs->pollCapacity) {
+        jobs->pollCapacity = (jobs->pollCapacity == 0 ? PID_TABLE_SIZE
+                : jobs->pollCapacity * 2);
+        jobs->pollFds = (struct pollfd *) realloc(jobs->pollFds,
+                sizeof(struct pollfd) * jobs->pollCapacity);
+        jobs->pollProcs = (struct jobProcess **) realloc(jobs->pollProcs,
+                sizeof(struct jobProcess *) * jobs->pollCapacity);
+    }
+
+    process->pollIndex = jobs->pollCount++;
+    jobs->pollFds[process->pollIndex].fd = process->pidFd;
+    jobs->pollFds[process->pollIndex].events = POLLIN;
+    jobs->pollFds[process->pollIndex].revents = 0;
+    jobs->pollProcs[process->pollIndex] = process;
+}
+
+
+
+/*
+ * Takes a reaped stage out of the pid table and clears its pid
+ */
+static void unhashProcess(struct jobTable *jobs,
+        struct jobProcess *process) {
+    struct jobProcess **link = &jobs->pidTable[hashPid(jobs, process->pid)];
+    int found = 0;
+
+    while(*link != NULL) {
+        if(*link == process) {
+            *link = process->hashNext;
+            --jobs->pidCount;
+            found = 1;
+            break;
+        }
+        link = &(*link)->hashNext;
+    }
+
+    // The last pidfd takes its place
+    if(jobs->byPid && found) {
+        unsigned int last = --jobs->pollCount;
+
+        jobs->pollFds[process->pollIndex] = jobs->pollFds[last];
+        jobs->pollProcs[process->pollIndex] = jobs->pollProcs[last];
+        jobs->pollProcs[process->pollIndex]->pollIndex = process->pollIndex;
+    }
+
+    if(process->pidFd != -1) {
+        close(process->pidFd);
+        process->pidFd = -1;
+    }
+
+    process->pid = 0;
+    process->hashNext = NULL;
+}
+
+
+
+/*
+ * Finds the stage of a job that has pid
+ */
+static struct jobProcess *findProcess(struct jobTable *jobs, pid_t pid) {
+    struct jobProcess *process;
+
+    if(jobs->pidCapacity == 0) {
+        return NULL;
+    }
+
+    for(process = jobs->pidTable[hashPid(jobs, pid)]; process != NULL;
+            process = process->hashNext) {
+        if(process->pid == pid) {
+            return process;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Takes a job off the list of jobs to report
+ */
+static void unlinkDone(struct jobTable *jobs, struct job *job) {
+    if(job->pendingReport) {
+        if(job->donePrev != NULL) {
+            job->donePrev->doneNext = job->doneNext;
+        } else if(jobs->firstDone == job) {
+            jobs->firstDone = job->doneNext;
+        }
+
+        if(job->doneNext != NULL) {
+            job->doneNext->donePrev = job->donePrev;
+        }
+    }
+
+    job->donePrev = NULL;
+    job->doneNext = NULL;
+    job->pendingReport = 0;
+}
+
+
+
+/*
+ * The signalfd, for loops that poll on more than handleEvents does
+ */
+int signalEventFd() {
+    return signalFd;
+}
+
+
+
+/*
+ * Starts watching for children and Ctrl-C. Both signals are blocked
+ * and read from a signalfd by handleEvents, so nothing runs inside a
+ * signal handler. Children get the signals back before they exec.
+ * An interactive shell also ignores the terminal's stop signals, so
+ * Ctrl-Z stops the job instead of the shell.
+ */
+void initJobs(int interactive) {
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signalFd == -1) {
+        printf("Error: %s\n", strerror(errno));
+    }
+
+    if(interactive) {
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+    }
+}
+
+
+
+/*
+ * Starts an empty job table. With byPid set it only ever waits for
+ * its own children, for an interpreter that shares the process.
+ */
+void initJobTable(struct jobTable *jobs, int byPid) {
+    memset(jobs, 0, sizeof(struct jobTable));
+    jobs->byPid = byPid;
+}
+
+
+
+/*
+ * Puts the signals back the way they were before initJobs.
+ * Only called in a child before it execs.
+ */
+void resetChildSignals() {
+    sigset_t none;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+}
+
+
+
+/*
+ * Gets an empty job, started now. It isn't in the table until addJob.
+ */
+struct job *newJob() {
+    struct job *job = (struct job *) calloc(1, sizeof(struct job));
+
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    return job;
+}
+
+
+
+/*
+ * Adds a started job to the table: it gets the next job number and
+ * each of its running stages goes into the pid table.
+ */
+void addJob(struct jobTable *jobs, struct job *job) {
+    int i;
+
+    job->id = (jobs->lastJob == NULL ? 1 : jobs->lastJob->id + 1);
+    job->prev = jobs->lastJob;
+    job->next = NULL;
+
+    if(jobs->lastJob == NULL) {
+        jobs->firstJob = job;
+    } else {
+        jobs->lastJob->next = job;
+    }
+    jobs->lastJob = job;
+
+    for(i = 0; i < job->numStages; ++i) {
+        if(job->procs[i].pid != 0) {
+            job->procs[i].job = job;
+            hashProcess(jobs, &job->procs[i]);
+        }
+    }
+}
+
+
+
+/*
+ * Takes a job out of the table and frees it. Stages that are still
+ * running are forgotten about, not killed.
+ */
+void removeJob(struct jobTable *jobs, struct job *job) {
+    int i;
+
+    for(i = 0; i < job->numStages; ++i) {
+        if(job->procs[i].pid != 0 && job->procs[i].job == job) {
+            unhashProcess(jobs, &job->procs[i]);
+        }
+
+        if(job->procs[i].fileOut != NULL) {
+            countOutput(job->procs[i].fileOut, job->procs[i].outStart);
+            free(job->procs[i].fileOut);
+        }
+    }
+
+    unlinkDone(jobs, job);
+
+    if(job->id != 0) {
+        if(job->prev != NULL) {
+            job->prev->next = job->next;
+        } else {
+            jobs->firstJob = job->next;
+        }
+
+        if(job->next != NULL) {
+            job->next->prev = job->prev;
+        } else {
+            jobs->lastJob = job->prev;
+        }
+    }
+
+    if(jobs->foregroundJob == job) {
+        jobs->foregroundJob = NULL;
+    }
+
+    free(job->command);
+    free(job);
+}
+
+
+
+/*
+ * Frees every job, for when the shell exits
+ */
+void freeJobs(struct jobTable *jobs) {
+    while(jobs->firstJob != NULL) {
+        removeJob(jobs, jobs->firstJob);
+    }
+
+    free(jobs->pidTable);
+    jobs->pidTable = NULL;
+    jobs->pidCapacity = 0;
+    jobs->pidCount = 0;
+
+    free(jobs->pollFds);
+    free(jobs->pollProcs);
+    jobs->pollFds = NULL;
+    jobs->pollProcs = NULL;
+    jobs->pollCapacity = 0;
+}
+
+
+
+/*
+ * Iterates over the jobs oldest first, start with NULL
+ */
+struct job *nextJob(struct jobTable *jobs, struct job *job) {
+    return (job == NULL ? jobs->firstJob : job->next);
+}
+
+
+
+/*
+ * Finds a job by its number
+ */
+struct job *findJob(struct jobTable *jobs, int id) {
+    struct job *job;
+
+    for(job = jobs->lastJob; job != NULL; job = job->prev) {
+        if(job->id == id) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Finds the job that started pid, any stage of it
+ */
+struct job *findJobByPid(struct jobTable *jobs, pid_t pid) {
+    struct jobProcess *process = findProcess(jobs, pid);
+
+    return (process == NULL ? NULL : process->job);
+}
+
+
+
+/*
+ * Sends sig to every stage of job. Jobs in their own process group
+ * get it through the group.
+ */
+void signalJob(struct job *job, int sig) {
+    int i;
+
+    if(job->pgid != 0) {
+        kill(-job->pgid, sig);
+        return;
+    }
+
+    for(i = 0; i < job->numStages; ++i) {
+        if(job->procs[i].pid != 0) {
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+
+
+/*
+ * Adds the resources in usage to total, max RSS is the larger of the two
+ */
+void addUsage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+
+    if(usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+
+
+/*
+ * Updates the job of a stage that exited, stopped or continued.
+ * wait4 hands back what each stage used, which adds up in its job.
+ */
+static void updateProcess(struct jobTable *jobs, struct jobProcess *process,
+        int status, struct rusage *usage) {
+    struct job *job = process->job;
+
+    if(WIFSTOPPED(status)) {
+        job->stopped = 1;
+        return;
+    }
+
+    if(WIFCONTINUED(status)) {
+        job->stopped = 0;
+        return;
+    }
+
+    LOG(LOG_INFO, "Child is done. Status: %d\n", status);
+
+    if(process == &job->procs[job->numStages - 1]) {
+        job->status = status;
+    }
+    addUsage(&job->usage, usage);
+    unhashProcess(jobs, process);
+
+    if(--job->running > 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    job->stopped = 0;
+
+    if(job != jobs->foregroundJob) {
+        traceJob(job);
+    }
+
+    // Nobody is waiting on a background job, report it later
+    if(job->background && !job->pendingReport) {
+        job->pendingReport = 1;
+        job->donePrev = NULL;
+        job->doneNext = jobs->firstDone;
+        if(jobs->firstDone != NULL) {
+            jobs->firstDone->donePrev = job;
+        }
+        jobs->firstDone = job;
+    }
+}
+
+
+
+/*
+ * Reaps every child that has exited (or stopped, or continued) and
+ * updates its job. Each one is found through the pid table, so it
+ * doesn't matter how many jobs there are. A table that reaps by pid
+ * only asks about the stages whose pidfd says they exited (and any
+ * without a pidfd), other children belong to someone else.
+ */
+static void reapChildren(struct jobTable *jobs) {
+    int options = WNOHANG | WUNTRACED | WCONTINUED;
+    struct rusage usage;
+    pid_t pid;
+    int status;
+    unsigned int i;
+
+    if(!jobs->byPid) {
+        while((pid = wait4(-1, &status, options, &usage)) > 0) {
+            struct jobProcess *process = findProcess(jobs, pid);
+
+            // Not one of our jobs otherwise
+            if(process != NULL) {
+                updateProcess(jobs, process, status, &usage);
+            }
+        }
+        return;
+    }
+
+    // Backwards, a reaped stage's place goes to one already looked at
+    for(i = jobs->pollCount; i-- > 0;) {
+        struct jobProcess *process = jobs->pollProcs[i];
+
+        if(jobs->pollFds[i].fd != -1 && jobs->pollFds[i].revents == 0) {
+            continue;
+        }
+
+        jobs->pollFds[i].revents = 0;
+        if(wait4(process->pid, &status, options, &usage) > 0) {
+            updateProcess(jobs, process, status, &usage);
+        }
+    }
+}
+
+
+
+/*
+ * Finds which of a by-pid table's own children exited, on their
+ * pidfds. With block set, sleeps until one does. Stages without a
+ * pidfd can't be slept on, then it just naps for a moment.
+ */
+static void waitForOwnChildren(struct jobTable *jobs, int block) {
+    int timeout = (block ? -1 : 0);
+    unsigned int i;
+
+    if(jobs->pollCount == 0) {
+        return;
+    }
+
+    for(i = 0; i < jobs->pollCount && timeout == -1; ++i) {
+        if(jobs->pollFds[i].fd == -1) {
+            timeout = REAP_POLL_INTERVAL;
+        }
+    }
+
+    while(poll(jobs->pollFds, jobs->pollCount, timeout) == -1
+            && errno == EINTR) {
+    }
+}
+
+
+
+/*
+ * Handles the signals waiting on the signalfd: reaps children and
+ * passes Ctrl-C on to the foreground job. With block set, sleeps
+ * until there is at least one signal. A table that reaps by pid
+ * sleeps until one of its children exits instead, the shell's
+ * signals aren't its business.
+ * Returns how many times Ctrl-C was pressed.
+ */
+int handleEvents(struct jobTable *jobs, int block) {
+    struct signalfd_siginfo info;
+    int interrupts = 0;
+    int children = 0;
+
+    if(jobs->byPid) {
+        waitForOwnChildren(jobs, block);
+        reapChildren(jobs);
+        return 0;
+    }
+
+    if(signalFd == -1) {
+        // No signalfd, fall back to waiting on the children directly
+        if(block) {
+            siginfo_t child;
+            waitid(P_ALL, 0, &child, WEXITED | WSTOPPED | WCONTINUED | WNOWAIT);
+        }
+        reapChildren(jobs);
+        return 0;
+    }
+
+    if(block) {
+        struct pollfd event = {signalFd, POLLIN, 0};
+        int ready;
+
+        // Wakes up for the metrics file while a long job runs
+        while((ready = poll(&event, 1, metricsTimeout())) == 0
+                || (ready == -1 && errno == EINTR)) {
+            checkMetrics();
+        }
+    }
+
+    while(read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+        if(info.ssi_signo == SIGCHLD) {
+            children = 1;
+        } else if(info.ssi_signo == SIGINT) {
+            ++interrupts;
+        }
+    }
+
+    if(interrupts > 0) {
+        LOG(LOG_INFO, "Got ctrl-c\n");
+        jobs->interrupted += interrupts;
+
+        if(displayCommand) {
+            printf("Ctr-C");
+        }
+
+        if(jobs->foregroundJob != NULL) {
+            // Terminate the foreground process
+            signalJob(jobs->foregroundJob, SIGKILL);
+            printf("\n");
+        }
+    }
+
+    if(children) {
+        reapChildren(jobs);
+    }
+
+    return interrupts;
+}
+
+
+
+/*
+ * Sleeps for seconds in the shell itself, for the sleep builtin.
+ * Children are reaped in the meantime. Returns 1 if Ctrl-C cut it
+ * short.
+ */
+int pauseShell(struct jobTable *jobs, double seconds) {
+    struct pollfd event = {signalFd, POLLIN, 0};
+    struct timespec now, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += (time_t) seconds;
+    end.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+    if(end.tv_nsec >= 1000000000) {
+        end.tv_nsec -= 1000000000;
+        ++end.tv_sec;
+    }
+
+    while(1) {
+        double left;
+        int timeout;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (end.tv_sec - now.tv_sec) + (end.tv_nsec - now.tv_nsec) / 1e9;
+        if(left <= 0) {
+            return 0;
+        }
+
+        if(signalFd == -1 || jobs->byPid) {
+            struct timespec rest = {(time_t) left,
+                    (long) ((left - (time_t) left) * 1e9)};
+
+            nanosleep(&rest, NULL);
+            continue;
+        }
+
+        // Round up, waking early would just spin. Long sleeps go an
+        // hour at a time.
+        timeout = (left > 3600 ? 3600000 : (int) (left * 1000) + 1);
+        if(poll(&event, 1, timeout) > 0 && handleEvents(jobs, 0) > 0) {
+            return 1;
+        }
+    }
+}
+
+
+
+/*
+ * Blocks until fd has input, reaping children and catching Ctrl-C
+ * while the shell sits at the prompt. Logged messages are written out
+ * first, someone is watching.
+ */
+void waitForInput(struct jobTable *jobs, int fd) {
+    struct pollfd events[2] = {{fd, POLLIN, 0}, {signalFd, POLLIN, 0}};
+
+    flushLog();
+    flushTrace();
+
+    if(signalFd == -1) {
+        return;
+    }
+
+    while(1) {
+        int ready = poll(events, 2, metricsTimeout());
+
+        if(ready == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        if(ready == 0) {
+            checkMetrics();
+            continue;
+        }
+
+        if(events[1].revents != 0 && handleEvents(jobs, 0) > 0) {
+            printf("\n>> ");
+            fflush(stdout);
+        }
+
+        if(events[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+
+
+/*
+ * Waits until every stage of job has finished, or the job stopped.
+ * Ctrl-C in the meantime kills it.
+ */
+void waitForJob(struct jobTable *jobs, struct job *job) {
+    struct job *savedForeground = jobs->foregroundJob;
+
+    jobs->foregroundJob = job;
+
+    while(job->running > 0 && !job->stopped) {
+        handleEvents(jobs, 1);
+    }
+
+    jobs->foregroundJob = savedForeground;
+}
+
+
+
+/*
+ * Waits until some background job finishes, if any are running
+ */
+void waitForAnyJob(struct jobTable *jobs) {
+    while(jobs->firstDone == NULL) {
+        struct job *job = jobs->firstJob;
+
+        while(job != NULL && (job->running == 0 || job->stopped)) {
+            job = job->next;
+        }
+
+        if(job == NULL) {
+            return;
+        }
+
+        handleEvents(jobs, 1);
+    }
+}
+
+
+
+/*
+ * The most recently started job, what fg and bg use by default
+ */
+struct job *currentJob(struct jobTable *jobs) {
+    return jobs->lastJob;
+}
+
+
+
+/*
+ * Prints one line about a job: number, pid, state, how long it has
+ * been running (or ran for) and the command.
+ */
+void printJob(FILE *out, struct job *job) {
+    struct timespec end = job->end;
+    char state[32];
+    double seconds;
+
+    if(job->running > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        strcpy(state, job->stopped ? "Stopped" : "Running");
+    } else if(WIFSIGNALED(job->status)) {
+        sprintf(state, "Signal %d", WTERMSIG(job->status));
+    } else if(WEXITSTATUS(job->status) != 0) {
+        sprintf(state, "Exit %d", WEXITSTATUS(job->status));
+    } else {
+        strcpy(state, "Done");
+    }
+
+    seconds = (end.tv_sec - job->start.tv_sec)
+            + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+
+    fprintf(out, "[%d] %d %-10s %8.2fs %s\n", job->id,
+            (int) job->lastPid, state, seconds,
+            job->command);
+}
+
+
+
+/*
+ * The jobs command, prints every job. Finished ones have been
+ * reported now, so they're dropped.
+ */
+void listJobs(struct jobTable *jobs, FILE *out) {
+    struct job *job = jobs->firstJob;
+
+    while(job != NULL) {
+        struct job *next = job->next;
+
+        printJob(out, job);
+        if(job->running == 0) {
+            removeJob(jobs, job);
+        }
+
+        job = next;
+    }
+}
+
+
+
+/*
+ * Drops background jobs that have finished since the last call,
+ * printing them first when verbose.
+ */
+void reportJobs(struct jobTable *jobs, int verbose) {
+    while(jobs->firstDone != NULL) {
+        struct job *job = jobs->firstDone;
+
+        if(verbose) {
+            printJob(stdout, job);
+        }
+
+        removeJob(jobs, job);
+    }
+}
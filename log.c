@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "xssh.h"
+
+// Messages are collected here and written to stderr in one go
+#define LOG_BUFFER_SIZE 65536
+
+// Flush before a message when less room than this is left
+#define LOG_LINE_ROOM 1024
+
+int logLevel = LOG_INFO;
+
+static char logBuffer[LOG_BUFFER_SIZE];
+static size_t logUsed = 0;
+
+// -P scripts log from their own threads
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * Writes out the buffer, with logLock held
+ */
+static void writeLog() {
+    size_t written = 0;
+
+    while(written < logUsed) {
+        ssize_t count = write(2, logBuffer + written, logUsed - written);
+
+        if(count == -1 && errno == EINTR) {
+            continue;
+        }
+        if(count <= 0) {
+            break;
+        }
+        written += count;
+    }
+
+    logUsed = 0;
+}
+
+
+
+/*
+ * Writes out everything logged so far
+ */
+void flushLog() {
+    pthread_mutex_lock(&logLock);
+    writeLog();
+    pthread_mutex_unlock(&logLock);
+}
+
+
+
+/*
+ * Sets the level from -d and makes sure the buffer gets written out
+ * when the shell exits.
+ */
+void initLog(int level) {
+    logLevel = level;
+    atexit(flushLog);
+}
+
+
+
+/*
+ * Formats a message into the buffer. Only called through LOG, which
+ * has already checked the level.
+ */
+void logMessage(const char *format, ...) {
+    va_list args;
+    size_t room;
+    int length;
+
+    pthread_mutex_lock(&logLock);
+
+    if(LOG_BUFFER_SIZE - logUsed < LOG_LINE_ROOM) {
+        writeLog();
+    }
+
+    room = LOG_BUFFER_SIZE - logUsed;
+
+    va_start(args, format);
+    length = vsnprintf(logBuffer + logUsed, room, format, args);
+    va_end(args);
+
+    if(length >= 0) {
+        // Didn't fit, it gets cut off at the end of the buffer
+        if((size_t) length >= room) {
+            length = room - 1;
+        }
+
+        logUsed += length;
+    }
+
+    pthread_mutex_unlock(&logLock);
+}
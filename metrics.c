@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xssh.h"
+
+// Upper bounds of the spawn latency buckets, in seconds
+static const double spawnBuckets[NUM_SPAWN_BUCKETS] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1
+};
+
+__thread struct metrics metrics;
+
+// --metrics-file, and how often it gets rewritten
+static char *metricsPath = NULL;
+static int metricsInterval = 15;
+static struct timespec lastDump;
+
+// The thread that writes the file, the one with the shell's counters
+static pthread_t metricsThread;
+
+// -P scripts adding up their counters as they end
+static pthread_mutex_t addLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * Seconds between two points on the monotonic clock
+ */
+static double elapsed(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec)
+            + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+
+/*
+ * Counts one program start and how long spawnProcess took over it
+ */
+void countSpawn(int started, double seconds) {
+    int i;
+
+    if(started) {
+        ++metrics.execs;
+    } else {
+        ++metrics.execFailures;
+    }
+
+    for(i = 0; i < NUM_SPAWN_BUCKETS; ++i) {
+        if(seconds <= spawnBuckets[i]) {
+            ++metrics.spawnBuckets[i];
+            break;
+        }
+    }
+
+    ++metrics.spawnCount;
+    metrics.spawnSeconds += seconds;
+}
+
+
+
+/*
+ * Size of a file, 0 when it isn't there
+ */
+off_t fileSize(char *path) {
+    struct stat info;
+
+    if(stat(path, &info) == -1) {
+        return 0;
+    }
+
+    return info.st_size;
+}
+
+
+
+/*
+ * Counts a file redirected into a command as read in full
+ */
+void countInput(char *path) {
+    metrics.bytesIn += fileSize(path);
+}
+
+
+
+/*
+ * Counts what a finished command wrote to its > file. The file isn't
+ * truncated, so that's how much it grew from start.
+ */
+void countOutput(char *path, off_t start) {
+    off_t size = fileSize(path);
+
+    if(size > start) {
+        metrics.bytesOut += size - start;
+    }
+}
+
+
+
+/*
+ * Adds this thread's counters to total, the shell's. Called by a -P
+ * script as it ends.
+ */
+void addMetrics(struct metrics *total) {
+    int i;
+
+    pthread_mutex_lock(&addLock);
+
+    total->commands += metrics.commands;
+    total->builtins += metrics.builtins;
+    total->forks += metrics.forks;
+    total->execs += metrics.execs;
+    total->execFailures += metrics.execFailures;
+    total->varLookups += metrics.varLookups;
+    total->varMisses += metrics.varMisses;
+    total->bytesIn += metrics.bytesIn;
+    total->bytesOut += metrics.bytesOut;
+    for(i = 0; i < NUM_SPAWN_BUCKETS; ++i) {
+        total->spawnBuckets[i] += metrics.spawnBuckets[i];
+    }
+    total->spawnCount += metrics.spawnCount;
+    total->spawnSeconds += metrics.spawnSeconds;
+
+    pthread_mutex_unlock(&addLock);
+}
+
+
+
+/*
+ * Writes one counter with its help and type lines
+ */
+static void writeCounter(FILE *out, char *name, char *help,
+        unsigned long value) {
+    fprintf(out, "# HELP %s %s\n", name, help);
+    fprintf(out, "# TYPE %s counter\n", name);
+    fprintf(out, "%s %lu\n", name, value);
+}
+
+
+
+/*
+ * Writes every metric in the Prometheus text format
+ */
+void writeMetrics(FILE *out) {
+    unsigned long cumulative = 0;
+    int i;
+
+    writeCounter(out, "xssh_commands_total",
+            "Commands run, builtins and pipelines.", metrics.commands);
+    writeCounter(out, "xssh_builtins_total",
+            "Builtins run in the shell.", metrics.builtins);
+    writeCounter(out, "xssh_forks_total",
+            "Child processes the shell tried to start.", metrics.forks);
+    writeCounter(out, "xssh_execs_total",
+            "Programs started.", metrics.execs);
+    writeCounter(out, "xssh_exec_failures_total",
+            "Programs that couldn't be started.", metrics.execFailures);
+    writeCounter(out, "xssh_var_lookups_total",
+            "Local variable lookups.", metrics.varLookups);
+    writeCounter(out, "xssh_var_misses_total",
+            "Local variable lookups that found nothing.", metrics.varMisses);
+    writeCounter(out, "xssh_redirect_read_bytes_total",
+            "Bytes in files redirected into commands.", metrics.bytesIn);
+    writeCounter(out, "xssh_redirect_written_bytes_total",
+            "Bytes commands wrote to redirected files.", metrics.bytesOut);
+
+    fprintf(out, "# HELP xssh_spawn_latency_seconds "
+            "Time to start one program.\n");
+    fprintf(out, "# TYPE xssh_spawn_latency_seconds histogram\n");
+    for(i = 0; i < NUM_SPAWN_BUCKETS; ++i) {
+        cumulative += metrics.spawnBuckets[i];
+        fprintf(out, "xssh_spawn_latency_seconds_bucket{le=\"%g\"} %lu\n",
+                spawnBuckets[i], cumulative);
+    }
+    fprintf(out, "xssh_spawn_latency_seconds_bucket{le=\"+Inf\"} %lu\n",
+            metrics.spawnCount);
+    fprintf(out, "xssh_spawn_latency_seconds_sum %.9f\n",
+            metrics.spawnSeconds);
+    fprintf(out, "xssh_spawn_latency_seconds_count %lu\n",
+            metrics.spawnCount);
+}
+
+
+
+/*
+ * Rewrites the metrics file. It's written under a temporary name and
+ * renamed over the old one, so a scrape never sees half a file.
+ * Only the thread that called initMetrics writes it.
+ */
+void dumpMetrics() {
+    char tmpPath[PATH_MAX];
+    FILE *out;
+    int ok;
+
+    if(metricsPath == NULL || !pthread_equal(pthread_self(), metricsThread)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &lastDump);
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", metricsPath, (int) getpid());
+    out = fopen(tmpPath, "w");
+    if(out == NULL) {
+        LOG(LOG_INFO, "Can't write metrics %s: %s\n", tmpPath,
+                strerror(errno));
+        return;
+    }
+
+    writeMetrics(out);
+    ok = !ferror(out);
+
+    if(fclose(out) != 0 || !ok || rename(tmpPath, metricsPath) == -1) {
+        LOG(LOG_INFO, "Can't write metrics %s\n", metricsPath);
+        unlink(tmpPath);
+    }
+}
+
+
+
+/*
+ * Turns on the metrics file, rewritten every interval seconds and
+ * once more when the shell exits
+ */
+void initMetrics(char *path, int interval) {
+    metricsPath = path;
+    metricsThread = pthread_self();
+    if(interval > 0) {
+        metricsInterval = interval;
+    }
+
+    dumpMetrics();
+    atexit(dumpMetrics);
+}
+
+
+
+/*
+ * Milliseconds until the metrics file is due, for poll.
+ * -1 when there is no metrics file, or it isn't this thread's.
+ */
+int metricsTimeout() {
+    struct timespec now;
+    double left;
+
+    if(metricsPath == NULL || !pthread_equal(pthread_self(), metricsThread)) {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = metricsInterval - elapsed(&lastDump, &now);
+
+    return (left <= 0 ? 0 : (int) (left * 1000) + 1);
+}
+
+
+
+/*
+ * Rewrites the metrics file if it's due. Cheap enough to call after
+ * every command.
+ */
+void checkMetrics() {
+    if(metricsTimeout() == 0) {
+        dumpMetrics();
+    }
+}
@@ -0,0 +1,1276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "xssh.h"
+
+// Starting size of a script's arena
+#define PROGRAM_ARENA_SIZE 65536
+
+// Starting size of the arena a typed function is copied into
+#define COPY_ARENA_SIZE 4096
+
+// Cache files start with this, bump the version whenever the layout changes
+#define CACHE_MAGIC "XSSHPRG"
+#define CACHE_VERSION 10
+
+
+// Internal commands, indexed by opcode
+const struct builtin builtins[NUM_OPCODES] = {
+    {NULL, 0}, {"show", 0}, {"set", 0}, {"unset", 0}, {"export", 0},
+    {"unexport", 0}, {"hash", 0}, {"memstat", 0}, {"chdir", 0},
+    {"exit", 0}, {"wait", 0}, {"jobs", 0}, {"fg", 0}, {"bg", 0},
+    {"stats", 0}, {"source", 0}, {"echo", 1}, {"true", 1}, {"false", 1}, {"test", 1},
+    {"[", 1}, {"pwd", 1}, {"sleep", 1}, {"cat", 1}, {"time", 0},
+    {"parallel", 0}, {"end", 0}, {"if", 0}, {"then", 0}, {"else", 0},
+    {"fi", 0}, {"while", 0}, {"do", 0}, {"done", 0}, {"for", 0},
+    {"function", 0}, {"}", 0}, {NULL, 0}
+};
+
+// Name to opcode hash table, filled from builtins on first use.
+// A power of two, well over twice the number of builtins.
+#define BUILTIN_TABLE_SIZE 128
+
+static unsigned char builtinTable[BUILTIN_TABLE_SIZE];
+static pthread_once_t builtinTableFilled = PTHREAD_ONCE_INIT;
+
+/*
+ * A file source has parsed, handed out again for as long as the file
+ * stays the same
+ */
+struct sourcedScript {
+    char *path;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    struct program *program;        /* the cache's own hold on it */
+    struct sourcedScript *next;
+};
+
+// Every file sourced so far, shared by -P scripts
+static struct sourcedScript *sourcedScripts = NULL;
+static pthread_mutex_t sourcedLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Layout of a cache file: the header, then every command, then every
+ * word, then all of the strings. Links between commands are indexes
+ * into the command records, -1 for none.
+ */
+struct cacheHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int numCommands;
+    unsigned int numWords;
+    unsigned int stringBytes;
+    long long mtime;                /* of the script when it was parsed */
+    long long mtimeNsec;
+    long long size;
+    unsigned long long hash;        /* of the script's contents */
+};
+
+struct cacheCommand {
+    int opcode;
+    int argCount;
+    int firstArg;                   /* word index */
+    int fileIn;                     /* word index */
+    int fileOut;                    /* word index */
+    int background;
+    int lineNumber;
+    int pipeNext;                   /* command index */
+    int next;                       /* command index */
+    int body;                       /* command index */
+    int condition;                  /* command index */
+    int elseBody;                   /* command index */
+};
+
+struct cacheWord {
+    unsigned int text;              /* offset into the strings */
+    int isVar;
+};
+
+// Everything needed while writing a cache file
+struct cacheWriter {
+    struct cacheCommand *commands;
+    struct cacheWord *words;
+    char *strings;
+    unsigned int numCommands;
+    unsigned int numWords;
+    unsigned int stringBytes;
+};
+
+
+
+/*
+ * Hash of a command name for the builtin table
+ */
+static unsigned int hashBuiltinName(const char *name) {
+    unsigned int hash = 2166136261u;
+
+    while(*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Puts every builtin into the name table. Empty slots are 0, which is
+ * OP_EXTERNAL.
+ */
+static void fillBuiltinTable() {
+    int opcode;
+
+    for(opcode = OP_EXTERNAL + 1; opcode < NUM_OPCODES; ++opcode) {
+        unsigned int i;
+
+        if(builtins[opcode].name == NULL) {
+            continue;
+        }
+
+        i = hashBuiltinName(builtins[opcode].name) & (BUILTIN_TABLE_SIZE - 1);
+        while(builtinTable[i] != OP_EXTERNAL) {
+            i = (i + 1) & (BUILTIN_TABLE_SIZE - 1);
+        }
+        builtinTable[i] = opcode;
+    }
+}
+
+
+
+/*
+ * Finds the opcode for an internal command name.
+ * Returns OP_EXTERNAL if name isn't one.
+ */
+int lookupBuiltin(char *name) {
+    unsigned int i;
+
+    // -P scripts may get here at the same time
+    pthread_once(&builtinTableFilled, fillBuiltinTable);
+
+    i = hashBuiltinName(name) & (BUILTIN_TABLE_SIZE - 1);
+    while(builtinTable[i] != OP_EXTERNAL) {
+        if(strcmp(name, builtins[builtinTable[i]].name) == 0) {
+            return builtinTable[i];
+        }
+        i = (i + 1) & (BUILTIN_TABLE_SIZE - 1);
+    }
+
+    return OP_EXTERNAL;
+}
+
+
+
+/*
+ * Copies a token into the arena as a word
+ */
+static void copyWord(struct arena *arena, struct word *word, char *token) {
+    word->text = arenaStrdup(arena, token);
+    word->isVar = (strchr(token, '$') != NULL);
+}
+
+
+
+/*
+ * Gets a zeroed command from the arena
+ */
+static struct command *newCommand(struct arena *arena, int lineNumber) {
+    struct command *command = (struct command *)
+            arenaAlloc(arena, sizeof(struct command));
+
+    memset(command, 0, sizeof(struct command));
+    command->lineNumber = lineNumber;
+
+    return command;
+}
+
+
+
+/*
+ * A command that just reports why its line couldn't be parsed.
+ * The message shows up when the line would have run.
+ */
+static struct command *errorCommand(struct arena *arena, char *message,
+        int lineNumber) {
+    struct command *command = newCommand(arena, lineNumber);
+
+    command->opcode = OP_ERROR;
+    command->argCount = 1;
+    command->args = (struct word *) arenaAlloc(arena, sizeof(struct word));
+    copyWord(arena, command->args, message);
+
+    return command;
+}
+
+
+
+/*
+ * Builds one stage of a pipeline out of its tokens.
+ * "< file" and "> file" are pulled out of the args.
+ */
+static struct command *parseStage(struct arena *arena, char **tokens,
+        int count, int lineNumber) {
+    struct command *stage = newCommand(arena, lineNumber);
+    int i;
+
+    stage->opcode = lookupBuiltin(tokens[0]);
+    stage->args = (struct word *) arenaAlloc(arena,
+            sizeof(struct word) * count);
+
+    for(i = 0; i < count; ++i) {
+        if(strcmp(tokens[i], ">") == 0 || strcmp(tokens[i], "<") == 0) {
+            // there are more args, should be the file name
+            if(i+1 < count) {
+                struct word *file = (struct word *)
+                        arenaAlloc(arena, sizeof(struct word));
+
+                copyWord(arena, file, tokens[i+1]);
+                if(tokens[i][0] == '>') {
+                    stage->fileOut = file;
+                } else {
+                    stage->fileIn = file;
+                }
+                ++i;
+            }
+            continue;
+        }
+
+        copyWord(arena, &stage->args[stage->argCount++], tokens[i]);
+    }
+
+    return stage;
+}
+
+
+
+/*
+ * Whether opcode is one of the words that open or close a block, which
+ * make no sense as a stage of a pipeline
+ */
+static int isBlockWord(int opcode) {
+    return opcode == OP_TIME
+            || (opcode >= OP_PARALLEL && opcode <= OP_FUNCTION_END);
+}
+
+
+
+/*
+ * Builds a command out of a line's tokens. "time" takes the rest of
+ * the line as the command it times, "if" and "while" as the condition
+ * they test.
+ */
+static struct command *parseTokens(struct arena *arena, char **tokens,
+        int count, int lineNumber) {
+    struct command *first = NULL;
+    struct command *last = NULL;
+    int background = 0;
+    int hasPipe = 0;
+    int start = 0;
+    int opcode = lookupBuiltin(tokens[0]);
+    int i;
+
+    if(opcode == OP_TIME || opcode == OP_IF || opcode == OP_WHILE) {
+        struct command *rest = NULL;
+
+        if(count > 1) {
+            rest = parseTokens(arena, tokens + 1, count - 1, lineNumber);
+        } else if(opcode != OP_TIME) {
+            char message[MAX_VAR_SIZE];
+
+            snprintf(message, sizeof(message),
+                    "Error: %s without a condition", tokens[0]);
+            return errorCommand(arena, message, lineNumber);
+        }
+
+        first = newCommand(arena, lineNumber);
+        first->opcode = opcode;
+        first->argCount = 1;
+        first->args = (struct word *) arenaAlloc(arena, sizeof(struct word));
+        copyWord(arena, first->args, tokens[0]);
+
+        if(opcode == OP_TIME) {
+            first->body = rest;
+        } else {
+            first->condition = rest;
+        }
+        return first;
+    }
+
+    if(opcode == OP_FOR && (count < 3 || strcmp(tokens[2], "in") != 0)) {
+        return errorCommand(arena, "Error: for needs a name and in",
+                lineNumber);
+    }
+
+    if(opcode == OP_FUNCTION && (count != 3 || strcmp(tokens[2], "{") != 0
+            || strchr(tokens[1], '$') != NULL)) {
+        return errorCommand(arena, "Error: function needs a name and {",
+                lineNumber);
+    }
+
+    if(opcode == OP_FUNCTION && lookupBuiltin(tokens[1]) != OP_EXTERNAL) {
+        char message[MAX_VAR_SIZE];
+
+        snprintf(message, sizeof(message), "Error: %s is a builtin",
+                tokens[1]);
+        return errorCommand(arena, message, lineNumber);
+    }
+
+    for(i = 0; i < count; ++i) {
+        if(strcmp(tokens[i], "|") == 0) {
+            hasPipe = 1;
+        }
+    }
+
+    // A builtin on its own takes every word as an arg. Utilities are
+    // parsed like programs, they may be run as one.
+    if(!hasPipe && opcode != OP_EXTERNAL && !builtins[opcode].utility) {
+        first = newCommand(arena, lineNumber);
+        first->opcode = opcode;
+        first->argCount = count;
+        first->args = (struct word *) arenaAlloc(arena,
+                sizeof(struct word) * count);
+
+        for(i = 0; i < count; ++i) {
+            copyWord(arena, &first->args[i], tokens[i]);
+        }
+
+        return first;
+    }
+
+    // Check to see if parent should wait
+    for(i = 0; i < count; ++i) {
+        if(tokens[i][0] == '&') {
+            background = 1;
+            count = i;
+            break;
+        }
+    }
+
+    // Split the tokens into stages at each |
+    for(i = 0; i <= count; ++i) {
+        struct command *stage;
+
+        if(i < count && strcmp(tokens[i], "|") != 0) {
+            continue;
+        }
+
+        if(i == start) {
+            return errorCommand(arena, "Error: empty command in pipeline",
+                    lineNumber);
+        }
+
+        stage = parseStage(arena, tokens + start, i - start, lineNumber);
+        if(stage->argCount == 0) {
+            return errorCommand(arena, "Error: empty command in pipeline",
+                    lineNumber);
+        }
+
+        if(isBlockWord(stage->opcode) || stage->opcode == OP_SOURCE) {
+            char message[MAX_VAR_SIZE];
+
+            snprintf(message, sizeof(message),
+                    "Error: %s can't be part of a pipeline", tokens[start]);
+            return errorCommand(arena, message, lineNumber);
+        }
+
+        if(first == NULL) {
+            first = stage;
+        } else {
+            last->pipeNext = stage;
+        }
+        last = stage;
+
+        start = i + 1;
+    }
+
+    first->background = background;
+    return first;
+}
+
+
+
+/*
+ * Parses one line into commands allocated from arena, one for each
+ * part of the line between ;'s, linked through next.
+ * Builtins get their opcode, everything else becomes a pipeline of one
+ * or more stages with redirections and & already split out.
+ * Returns NULL for blank and commented out lines.
+ */
+struct command *parseLine(struct arena *arena, char *line, int lineNumber) {
+    char *tokens[MAX_LINE_WORDS + 1];
+    struct command *first = NULL;
+    struct command *last = NULL;
+    int count = 1;
+    int start = 0;
+    int i;
+
+    splitCommand(line, tokens, &count);
+
+    LOG(LOG_DEBUG, "arg count: %d\n", count);
+
+    // A ; of its own or at the end of a word ends a command
+    for(i = 0; i <= count; ++i) {
+        struct command *command;
+        int end = i;
+
+        if(i < count) {
+            size_t length = strlen(tokens[i]);
+
+            if(length == 0 || tokens[i][length - 1] != ';') {
+                continue;
+            }
+            tokens[i][length - 1] = 0;
+            if(length > 1) {
+                end = i + 1;
+            }
+        }
+
+        while(end > start) {
+            int length = end - start;
+            int opcode = lookupBuiltin(tokens[start]);
+
+            // then, else, do and "function name {" can have the next
+            // command right after
+            if(opcode == OP_THEN || opcode == OP_ELSE || opcode == OP_DO) {
+                length = 1;
+            } else if(opcode == OP_FUNCTION && length > 3
+                    && strcmp(tokens[start + 2], "{") == 0) {
+                length = 3;
+            }
+
+            // Words past MAX_ARGS are dropped, like they always were
+            command = parseTokens(arena, tokens + start,
+                    length > MAX_ARGS ? MAX_ARGS : length, lineNumber);
+            if(first == NULL) {
+                first = command;
+            } else {
+                last->next = command;
+            }
+            last = command;
+            start += length;
+        }
+
+        start = i + 1;
+    }
+
+    return first;
+}
+
+
+
+/*
+ * Starts putting together a new script
+ */
+void initBlockParser(struct blockParser *parser) {
+    memset(parser, 0, sizeof(struct blockParser));
+}
+
+
+
+/*
+ * Adds command to the end of the innermost open block,
+ * or to the top level when there isn't one.
+ */
+static void appendCommand(struct blockParser *parser,
+        struct command *command) {
+    struct command *last = parser->last[parser->depth];
+
+    if(last != NULL) {
+        last->next = command;
+    } else if(parser->depth > 0 && parser->inElse[parser->depth - 1]) {
+        parser->open[parser->depth - 1]->elseBody = command;
+    } else if(parser->depth > 0) {
+        parser->open[parser->depth - 1]->body = command;
+    } else {
+        parser->first = command;
+    }
+
+    parser->last[parser->depth] = command;
+}
+
+
+
+/*
+ * The word that closes a block opened by opcode
+ */
+static int closingWord(int opcode) {
+    switch(opcode) {
+        case OP_IF:
+            return OP_FI;
+        case OP_WHILE:
+        case OP_FOR:
+            return OP_DONE;
+        case OP_FUNCTION:
+            return OP_FUNCTION_END;
+        default:
+            return OP_END;
+    }
+}
+
+
+
+/*
+ * Adds one command of a line to the script
+ */
+static void addOneCommand(struct blockParser *parser, struct arena *arena,
+        struct command *command) {
+    struct command *open = (parser->depth > 0
+            ? parser->open[parser->depth - 1] : NULL);
+    struct command *block = command;
+    char message[MAX_VAR_SIZE];
+
+    // "time parallel" opens the parallel block
+    while(block->opcode == OP_TIME && block->body != NULL) {
+        block = block->body;
+    }
+
+    switch(command->opcode) {
+        case OP_THEN:
+        case OP_DO:
+            // Only there to read like sh, the block is already open
+            if(open != NULL && (command->opcode == OP_THEN
+                        ? open->opcode == OP_IF
+                        : closingWord(open->opcode) == OP_DONE)
+                    && parser->last[parser->depth] == NULL
+                    && !parser->inElse[parser->depth - 1]) {
+                return;
+            }
+            snprintf(message, sizeof(message), "Error: unexpected %s",
+                    command->args[0].text);
+            appendCommand(parser, errorCommand(arena, message,
+                    command->lineNumber));
+            return;
+
+        case OP_ELSE:
+            if(open == NULL || open->opcode != OP_IF
+                    || parser->inElse[parser->depth - 1]) {
+                appendCommand(parser, errorCommand(arena,
+                        "Error: else without if", command->lineNumber));
+            } else {
+                parser->inElse[parser->depth - 1] = 1;
+                parser->last[parser->depth] = NULL;
+            }
+            return;
+
+        case OP_END:
+        case OP_FI:
+        case OP_DONE:
+        case OP_FUNCTION_END:
+            if(open == NULL || closingWord(open->opcode) != command->opcode) {
+                snprintf(message, sizeof(message),
+                        "Error: %s without a block", command->args[0].text);
+                appendCommand(parser, errorCommand(arena, message,
+                        command->lineNumber));
+            } else {
+                --parser->depth;
+            }
+            return;
+    }
+
+    if(block->opcode != OP_PARALLEL && block->opcode != OP_IF
+            && block->opcode != OP_WHILE && block->opcode != OP_FOR
+            && block->opcode != OP_FUNCTION) {
+        appendCommand(parser, command);
+        return;
+    }
+
+    if(parser->depth == MAX_BLOCK_DEPTH) {
+        appendCommand(parser, errorCommand(arena,
+                "Error: blocks nested too deep", command->lineNumber));
+        return;
+    }
+
+    appendCommand(parser, command);
+    parser->inElse[parser->depth] = 0;
+    parser->open[parser->depth++] = block;
+    parser->last[parser->depth] = NULL;
+}
+
+
+
+/*
+ * Adds the next parsed line to the script. A block's first line opens
+ * it and everything up to its end (or fi, or done) goes into its body.
+ * Returns how many blocks are still open, the script is only complete
+ * (and safe to run) at 0.
+ */
+int addCommand(struct blockParser *parser, struct arena *arena,
+        struct command *command) {
+    while(command != NULL) {
+        struct command *next = command->next;
+
+        // The commands of a line with ;'s go in one at a time
+        command->next = NULL;
+        addOneCommand(parser, arena, command);
+        command = next;
+    }
+
+    return parser->depth;
+}
+
+
+
+/*
+ * Called at the end of the input. Blocks that never got their end
+ * are turned into errors instead of running half of them.
+ */
+void closeBlocks(struct blockParser *parser, struct arena *arena) {
+    while(parser->depth > 0) {
+        struct command *block = parser->open[--parser->depth];
+        char message[MAX_VAR_SIZE];
+        struct command *error;
+
+        snprintf(message, sizeof(message), "Error: %s without %s",
+                builtins[block->opcode].name,
+                builtins[closingWord(block->opcode)].name);
+        error = errorCommand(arena, message, block->lineNumber);
+
+        block->opcode = OP_ERROR;
+        block->argCount = 1;
+        block->args = error->args;
+        block->body = NULL;
+        block->condition = NULL;
+        block->elseBody = NULL;
+    }
+}
+
+
+
+/*
+ * Wraps the whole program in a "parallel -j jobs" block, for -j
+ */
+void parallelProgram(struct program *program, char *jobs) {
+    struct command *block = newCommand(&program->arena, 0);
+
+    block->opcode = OP_PARALLEL;
+    block->argCount = 3;
+    block->args = (struct word *) arenaAlloc(&program->arena,
+            sizeof(struct word) * 3);
+    copyWord(&program->arena, &block->args[0], "parallel");
+    copyWord(&program->arena, &block->args[1], "-j");
+    copyWord(&program->arena, &block->args[2], jobs);
+
+    block->body = program->first;
+    program->first = block;
+}
+
+
+
+/*
+ * Copies count words into arena
+ */
+static struct word *copyWords(struct arena *arena, struct word *words,
+        int count) {
+    struct word *copy;
+    int i;
+
+    if(words == NULL) {
+        return NULL;
+    }
+
+    copy = (struct word *) arenaAlloc(arena,
+            sizeof(struct word) * (count > 0 ? count : 1));
+    for(i = 0; i < count; ++i) {
+        copy[i].text = arenaStrdup(arena, words[i].text);
+        copy[i].isVar = words[i].isVar;
+    }
+
+    return copy;
+}
+
+
+
+/*
+ * Copies a list of commands into arena, with their stages and blocks
+ */
+static struct command *copyCommands(struct arena *arena,
+        struct command *command) {
+    struct command *first = NULL;
+    struct command *last = NULL;
+
+    for(; command != NULL; command = command->next) {
+        struct command *copy = newCommand(arena, command->lineNumber);
+
+        copy->opcode = command->opcode;
+        copy->argCount = command->argCount;
+        copy->args = copyWords(arena, command->args, command->argCount);
+        copy->fileIn = copyWords(arena, command->fileIn, 1);
+        copy->fileOut = copyWords(arena, command->fileOut, 1);
+        copy->background = command->background;
+        copy->pipeNext = copyCommands(arena, command->pipeNext);
+        copy->body = copyCommands(arena, command->body);
+        copy->condition = copyCommands(arena, command->condition);
+        copy->elseBody = copyCommands(arena, command->elseBody);
+
+        if(first == NULL) {
+            first = copy;
+        } else {
+            last->next = copy;
+        }
+        last = copy;
+    }
+
+    return first;
+}
+
+
+
+/*
+ * Copies a block's body into a program of its own, for a function
+ * whose lines won't be kept, like one typed at the prompt
+ */
+struct program *copyBlock(struct command *body) {
+    struct program *program = (struct program *)
+            malloc(sizeof(struct program));
+
+    initArena(&program->arena, COPY_ARENA_SIZE);
+    program->refs = 1;
+    program->first = copyCommands(&program->arena, body);
+
+    return program;
+}
+
+
+
+/*
+ * FNV-1a over a chunk of the script, hash carries over between chunks
+ */
+static unsigned long long hashBytes(unsigned long long hash, char *bytes,
+        size_t length) {
+    size_t i;
+
+    for(i = 0; i < length; ++i) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+#define HASH_START 14695981039346656037ull
+
+
+
+/*
+ * Parses every line of the script into program.
+ * Returns the hash of the script's contents.
+ */
+static unsigned long long parseScript(struct program *program,
+        struct scriptReader *reader) {
+    struct blockParser parser;
+    unsigned long long hash = HASH_START;
+    int lineNumber = 0;
+    size_t length;
+    char *line;
+
+    initBlockParser(&parser);
+
+    while((line = nextLine(reader, &length)) != NULL) {
+        struct command *command;
+
+        ++lineNumber;
+        hash = hashBytes(hash, line, length);
+        if(reader->hadNewline) {
+            hash = hashBytes(hash, "\n", 1);
+        }
+
+        // No input
+        if(line[0] == 0) {
+            continue;
+        }
+
+        command = parseLine(&program->arena, line, lineNumber);
+        if(command == NULL) {
+            continue;
+        }
+
+        addCommand(&parser, &program->arena, command);
+    }
+
+    closeBlocks(&parser, &program->arena);
+    program->first = parser.first;
+
+    return hash;
+}
+
+
+
+/*
+ * Hash of the whole script file, to check a cache whose mtime is off.
+ * Uses pread so the file offset is left alone.
+ */
+static unsigned long long hashScript(int fd) {
+    char buffer[65536];
+    unsigned long long hash = HASH_START;
+    off_t offset = 0;
+    ssize_t length;
+
+    while((length = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+        hash = hashBytes(hash, buffer, length);
+        offset += length;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Gives every command a cache index, in the order they get written
+ */
+static void numberCommands(struct command *command, struct cacheWriter *writer) {
+    for(; command != NULL; command = command->next) {
+        struct command *stage;
+
+        for(stage = command; stage != NULL; stage = stage->pipeNext) {
+            stage->cacheIndex = writer->numCommands++;
+            writer->numWords += stage->argCount + (stage->fileIn != NULL)
+                    + (stage->fileOut != NULL);
+        }
+
+        numberCommands(command->condition, writer);
+        numberCommands(command->body, writer);
+        numberCommands(command->elseBody, writer);
+    }
+}
+
+
+
+/*
+ * Adds a word and its string to the cache being written.
+ * Returns the word's index.
+ */
+static int addCacheWord(struct cacheWriter *writer, struct word *word) {
+    unsigned int length = strlen(word->text) + 1;
+    struct cacheWord *record = &writer->words[writer->numWords];
+
+    writer->strings = (char *) realloc(writer->strings,
+            writer->stringBytes + length);
+    memcpy(writer->strings + writer->stringBytes, word->text, length);
+
+    record->text = writer->stringBytes;
+    record->isVar = word->isVar;
+    writer->stringBytes += length;
+
+    return (int) writer->numWords++;
+}
+
+
+
+/*
+ * Fills in the cache records for every command
+ */
+static void addCacheCommands(struct command *command,
+        struct cacheWriter *writer) {
+    for(; command != NULL; command = command->next) {
+        struct command *stage;
+
+        for(stage = command; stage != NULL; stage = stage->pipeNext) {
+            struct cacheCommand *record = &writer->commands[stage->cacheIndex];
+            int i;
+
+            record->opcode = stage->opcode;
+            record->argCount = stage->argCount;
+            record->firstArg = (int) writer->numWords;
+            for(i = 0; i < stage->argCount; ++i) {
+                addCacheWord(writer, &stage->args[i]);
+            }
+
+            record->fileIn = (stage->fileIn == NULL ? -1
+                    : addCacheWord(writer, stage->fileIn));
+            record->fileOut = (stage->fileOut == NULL ? -1
+                    : addCacheWord(writer, stage->fileOut));
+            record->background = stage->background;
+            record->lineNumber = stage->lineNumber;
+            record->pipeNext = (stage->pipeNext == NULL ? -1
+                    : stage->pipeNext->cacheIndex);
+            record->next = (stage == command && command->next != NULL
+                    ? command->next->cacheIndex : -1);
+            record->body = (stage->body == NULL ? -1
+                    : stage->body->cacheIndex);
+            record->condition = (stage->condition == NULL ? -1
+                    : stage->condition->cacheIndex);
+            record->elseBody = (stage->elseBody == NULL ? -1
+                    : stage->elseBody->cacheIndex);
+        }
+
+        addCacheCommands(command->condition, writer);
+        addCacheCommands(command->body, writer);
+        addCacheCommands(command->elseBody, writer);
+    }
+}
+
+
+
+/*
+ * Writes the parsed program to cachePath. The file is written under
+ * a temporary name and renamed, so readers never see half of it.
+ */
+static void writeCache(struct program *program, char *cachePath,
+        struct stat *info, unsigned long long hash) {
+    struct cacheWriter writer;
+    struct cacheHeader header;
+    char tmpPath[PATH_MAX];
+    FILE *fw;
+    int ok;
+
+    memset(&writer, 0, sizeof(writer));
+    numberCommands(program->first, &writer);
+
+    writer.commands = (struct cacheCommand *) calloc(writer.numCommands + 1,
+            sizeof(struct cacheCommand));
+    writer.words = (struct cacheWord *) calloc(writer.numWords + 1,
+            sizeof(struct cacheWord));
+    writer.numWords = 0;
+    addCacheCommands(program->first, &writer);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.numCommands = writer.numCommands;
+    header.numWords = writer.numWords;
+    header.stringBytes = writer.stringBytes;
+    header.mtime = info->st_mtim.tv_sec;
+    header.mtimeNsec = info->st_mtim.tv_nsec;
+    header.size = info->st_size;
+    header.hash = hash;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", cachePath, (int) getpid());
+    fw = fopen(tmpPath, "wb");
+
+    if(fw == NULL) {
+        LOG(LOG_INFO, "Can't write cache %s\n", tmpPath);
+    } else {
+        ok = fwrite(&header, sizeof(header), 1, fw) == 1
+            && fwrite(writer.commands, sizeof(struct cacheCommand),
+                    writer.numCommands, fw) == writer.numCommands
+            && fwrite(writer.words, sizeof(struct cacheWord),
+                    writer.numWords, fw) == writer.numWords
+            && fwrite(writer.strings, 1, writer.stringBytes, fw)
+                    == writer.stringBytes;
+
+        if(fclose(fw) != 0 || !ok || rename(tmpPath, cachePath) == -1) {
+            LOG(LOG_INFO, "Can't write cache %s\n", cachePath);
+            unlink(tmpPath);
+        }
+    }
+
+    free(writer.commands);
+    free(writer.words);
+    free(writer.strings);
+}
+
+
+
+/*
+ * Whether a cached word index is -1 (none) or one of the count words
+ */
+static int isWordIndex(int index, unsigned int count) {
+    return index == -1 || (index >= 0 && (unsigned int) index < count);
+}
+
+
+
+/*
+ * Whether a cached link of command self is -1 (none) or a command
+ * after it. The writer numbers commands before the ones they lead to,
+ * so a link back would be a damaged file, and a loop.
+ */
+static int isLaterCommand(int index, unsigned int self, unsigned int count) {
+    return index == -1 || (index >= 0 && (unsigned int) index > self
+            && (unsigned int) index < count);
+}
+
+
+
+/*
+ * Loads the parsed program from cachePath if it was made from this
+ * version of the script. A matching mtime and size is trusted as is,
+ * otherwise the script's contents are hashed and compared.
+ * Returns 0 if program was filled in, 1 if the cache was usable but
+ * stale on mtime (so should be rewritten), -1 if it can't be used.
+ */
+static int readCache(struct program *program, char *cachePath,
+        struct stat *info, int fd) {
+    struct cacheHeader header;
+    struct stat cacheInfo;
+    struct cacheCommand *records;
+    struct cacheWord *wordRecords;
+    struct command *commands;
+    struct word *words;
+    char *strings;
+    int fresh = 0;
+    unsigned int i;
+    FILE *fc = fopen(cachePath, "rb");
+
+    if(fc == NULL) {
+        return -1;
+    }
+
+    if(fread(&header, sizeof(header), 1, fc) != 1
+            || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != CACHE_VERSION
+            || header.size != (long long) info->st_size) {
+        fclose(fc);
+        return -1;
+    }
+
+    if(header.mtime == (long long) info->st_mtim.tv_sec
+            && header.mtimeNsec == (long long) info->st_mtim.tv_nsec) {
+        fresh = 1;
+    } else if(hashScript(fd) != header.hash) {
+        fclose(fc);
+        return -1;
+    }
+
+    // The counts have to add up to the file, before anything is sized
+    // by them
+    if(fstat(fileno(fc), &cacheInfo) == -1
+            || (unsigned long long) cacheInfo.st_size != sizeof(header)
+                + (unsigned long long) header.numCommands
+                    * sizeof(struct cacheCommand)
+                + (unsigned long long) header.numWords
+                    * sizeof(struct cacheWord)
+                + header.stringBytes) {
+        fclose(fc);
+        return -1;
+    }
+
+    records = (struct cacheCommand *) arenaAlloc(&program->arena,
+            sizeof(struct cacheCommand) * header.numCommands);
+    wordRecords = (struct cacheWord *) arenaAlloc(&program->arena,
+            sizeof(struct cacheWord) * header.numWords);
+    strings = (char *) arenaAlloc(&program->arena, header.stringBytes + 1);
+
+    if(fread(records, sizeof(struct cacheCommand), header.numCommands, fc)
+                != header.numCommands
+            || fread(wordRecords, sizeof(struct cacheWord), header.numWords,
+                fc) != header.numWords
+            || fread(strings, 1, header.stringBytes, fc)
+                != header.stringBytes) {
+        fclose(fc);
+        return -1;
+    }
+    fclose(fc);
+    strings[header.stringBytes] = 0;
+
+    // Don't trust a damaged file to point inside itself
+    for(i = 0; i < header.numCommands; ++i) {
+        struct cacheCommand *record = &records[i];
+
+        if(record->opcode < 0 || record->opcode >= NUM_OPCODES
+                || record->argCount < 1 || record->firstArg < 0
+                || (long long) record->firstArg + record->argCount
+                    > header.numWords
+                || !isWordIndex(record->fileIn, header.numWords)
+                || !isWordIndex(record->fileOut, header.numWords)
+                || !isLaterCommand(record->pipeNext, i, header.numCommands)
+                || !isLaterCommand(record->next, i, header.numCommands)
+                || !isLaterCommand(record->body, i, header.numCommands)
+                || !isLaterCommand(record->condition, i, header.numCommands)
+                || !isLaterCommand(record->elseBody, i, header.numCommands)
+                || ((record->opcode == OP_IF || record->opcode == OP_WHILE)
+                    && record->condition < 0)
+                || (record->opcode == OP_FOR && record->argCount < 3)) {
+            return -1;
+        }
+    }
+
+    // Turn the records back into linked commands
+    words = (struct word *) arenaAlloc(&program->arena,
+            sizeof(struct word) * header.numWords);
+    for(i = 0; i < header.numWords; ++i) {
+        words[i].text = strings + (wordRecords[i].text < header.stringBytes
+                ? wordRecords[i].text : header.stringBytes);
+        words[i].isVar = wordRecords[i].isVar;
+    }
+
+    commands = (struct command *) arenaAlloc(&program->arena,
+            sizeof(struct command) * header.numCommands);
+    for(i = 0; i < header.numCommands; ++i) {
+        struct cacheCommand *record = &records[i];
+
+        memset(&commands[i], 0, sizeof(struct command));
+        commands[i].opcode = record->opcode;
+        commands[i].argCount = record->argCount;
+        commands[i].args = words + record->firstArg;
+        commands[i].fileIn = (record->fileIn == -1 ? NULL
+                : words + record->fileIn);
+        commands[i].fileOut = (record->fileOut == -1 ? NULL
+                : words + record->fileOut);
+        commands[i].background = record->background;
+        commands[i].lineNumber = record->lineNumber;
+        commands[i].pipeNext = (record->pipeNext == -1 ? NULL
+                : commands + record->pipeNext);
+        commands[i].next = (record->next == -1 ? NULL
+                : commands + record->next);
+        commands[i].body = (record->body == -1 ? NULL
+                : commands + record->body);
+        commands[i].condition = (record->condition == -1 ? NULL
+                : commands + record->condition);
+        commands[i].elseBody = (record->elseBody == -1 ? NULL
+                : commands + record->elseBody);
+    }
+
+    program->first = (header.numCommands > 0 ? commands : NULL);
+
+    return (fresh ? 0 : 1);
+}
+
+
+
+/*
+ * Reads and parses the whole script at path once.
+ * With a cachePath, the parsed script is loaded from there when it is
+ * still current, and saved there when it isn't.
+ * Returns NULL if the script can't be opened.
+ */
+struct program *loadScript(char *path, char *cachePath) {
+    struct scriptReader reader;
+    struct program *program;
+    struct stat info;
+    unsigned long long hash;
+    int cached = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return NULL;
+    }
+
+    program = (struct program *) malloc(sizeof(struct program));
+    program->first = NULL;
+    program->refs = 1;
+    initArena(&program->arena, PROGRAM_ARENA_SIZE);
+
+    // Only regular files have an mtime worth keying a cache on
+    if(cachePath != NULL && (fstat(fd, &info) == -1
+            || !S_ISREG(info.st_mode))) {
+        cachePath = NULL;
+    }
+
+    if(cachePath != NULL) {
+        cached = readCache(program, cachePath, &info, fd);
+        LOG(LOG_INFO, "cache %s: %s\n", cachePath, cached == 0 ? "hit"
+                : (cached == 1 ? "hit, touched script" : "miss"));
+    }
+
+    if(cached == -1) {
+        openReader(&reader, fd);
+        hash = parseScript(program, &reader);
+        closeReader(&reader);
+    } else {
+        hash = 0;
+    }
+
+    // Miss, or the script was touched without changing
+    if(cachePath != NULL && cached != 0) {
+        if(cached == 1) {
+            hash = hashScript(fd);
+        }
+        writeCache(program, cachePath, &info, hash);
+    }
+
+    close(fd);
+    return program;
+}
+
+
+
+/*
+ * Loads the file at path for source. Regular files are parsed once and
+ * kept, the same parse is handed out again while the file's mtime and
+ * size stay the same, so a library that every script sources is only
+ * parsed the first time.
+ * Returns NULL if it can't be opened, otherwise a hold on the program
+ * for freeProgram to let go of.
+ */
+struct program *sourceScript(char *path) {
+    struct sourcedScript *entry;
+    struct program *program;
+    struct stat info;
+
+    if(stat(path, &info) == -1) {
+        return NULL;
+    }
+
+    if(!S_ISREG(info.st_mode)) {
+        return loadScript(path, NULL);
+    }
+
+    pthread_mutex_lock(&sourcedLock);
+
+    for(entry = sourcedScripts; entry != NULL; entry = entry->next) {
+        if(strcmp(entry->path, path) == 0) {
+            break;
+        }
+    }
+
+    if(entry != NULL && entry->device == info.st_dev
+            && entry->inode == info.st_ino
+            && entry->mtime.tv_sec == info.st_mtim.tv_sec
+            && entry->mtime.tv_nsec == info.st_mtim.tv_nsec
+            && entry->size == info.st_size) {
+        program = entry->program;
+        retainProgram(program);
+        pthread_mutex_unlock(&sourcedLock);
+
+        LOG(LOG_INFO, "source %s: cached\n", path);
+        return program;
+    }
+
+    program = loadScript(path, NULL);
+    if(program != NULL) {
+        if(entry == NULL) {
+            entry = (struct sourcedScript *)
+                    malloc(sizeof(struct sourcedScript));
+            entry->path = strdup(path);
+            entry->next = sourcedScripts;
+            sourcedScripts = entry;
+        } else {
+            // Whoever still runs the old one keeps it until they're done
+            freeProgram(entry->program);
+        }
+
+        entry->device = info.st_dev;
+        entry->inode = info.st_ino;
+        entry->mtime = info.st_mtim;
+        entry->size = info.st_size;
+        entry->program = program;
+        retainProgram(program);
+    }
+
+    pthread_mutex_unlock(&sourcedLock);
+    return program;
+}
+
+
+
+/*
+ * Takes another hold of a script, freeProgram lets go of it
+ */
+void retainProgram(struct program *program) {
+    __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+
+/*
+ * Lets go of a script. The last one to do so frees it and everything
+ * parsed out of it.
+ */
+void freeProgram(struct program *program) {
+    if(__atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    freeArena(&program->arena);
+    free(program);
+}
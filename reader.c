@@ -0,0 +1,163 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xssh.h"
+
+// How much a streaming reader asks read() for at a time
+#define READ_BLOCK_SIZE 65536
+
+
+
+/*
+ * Starts reading lines from fd. Regular files are mapped in one go,
+ * anything else (pipes, terminals, sockets) is read in large blocks.
+ * The reader doesn't own fd, closeReader leaves it open.
+ */
+void openReader(struct scriptReader *reader, int fd) {
+    struct stat info;
+
+    memset(reader, 0, sizeof(struct scriptReader));
+    reader->fd = fd;
+
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        // Private and writable so lines can be cut in place, only the
+        // pages that get a NUL written into them are ever copied
+        void *data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, fd, 0);
+
+        if(data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            reader->data = (char *) data;
+            reader->length = info.st_size;
+            reader->capacity = info.st_size;
+            reader->mapped = 1;
+            reader->eof = 1;
+
+            // Offset in the file the mapping starts at
+            reader->start = lseek(fd, 0, SEEK_CUR);
+            if(reader->start < 0 || reader->start > (off_t) reader->length) {
+                reader->start = 0;
+            }
+            reader->pos = reader->start;
+            return;
+        }
+    }
+
+    reader->capacity = READ_BLOCK_SIZE;
+    reader->data = (char *) malloc(reader->capacity);
+}
+
+
+
+/*
+ * Unmaps or frees the reader's buffer
+ */
+void closeReader(struct scriptReader *reader) {
+    if(reader->mapped) {
+        munmap(reader->data, reader->length);
+    } else {
+        free(reader->data);
+    }
+
+    free(reader->spill);
+    reader->data = NULL;
+    reader->spill = NULL;
+}
+
+
+
+/*
+ * Reads another block into a streaming reader. The unread part of the
+ * buffer is moved to the front first, the buffer doubles when a single
+ * line fills all of it.
+ * Returns the number of bytes read, 0 at end of input.
+ */
+static ssize_t fillReader(struct scriptReader *reader) {
+    ssize_t count;
+
+    if(reader->pos > 0) {
+        memmove(reader->data, reader->data + reader->pos,
+                reader->length - reader->pos);
+        reader->length -= reader->pos;
+        reader->pos = 0;
+    }
+
+    // Keep one byte free for the NUL after the last line
+    if(reader->length + 1 >= reader->capacity) {
+        reader->capacity *= 2;
+        reader->data = (char *) realloc(reader->data, reader->capacity);
+    }
+
+    do {
+        count = read(reader->fd, reader->data + reader->length,
+                reader->capacity - reader->length - 1);
+    } while(count == -1 && errno == EINTR);
+
+    if(count <= 0) {
+        reader->eof = 1;
+        return 0;
+    }
+
+    reader->length += count;
+    return count;
+}
+
+
+
+/*
+ * Returns the next line, NUL terminated in place with its newline cut
+ * off, and its length through length. Lines can be any length.
+ * The line stays valid until the next call.
+ * Returns NULL at end of input.
+ */
+char *nextLine(struct scriptReader *reader, size_t *length) {
+    char *line, *newline;
+    size_t scanned = 0;
+
+    while(1) {
+        line = reader->data + reader->pos;
+        newline = (char *) memchr(line + scanned, '\n',
+                reader->length - reader->pos - scanned);
+
+        if(newline != NULL || reader->eof) {
+            break;
+        }
+
+        scanned = reader->length - reader->pos;
+        fillReader(reader);
+    }
+
+    if(newline != NULL) {
+        *newline = 0;
+        *length = newline - line;
+        reader->pos += *length + 1;
+        reader->hadNewline = 1;
+        return line;
+    }
+
+    // Last line, without a newline
+    *length = reader->length - reader->pos;
+    if(*length == 0) {
+        return NULL;
+    }
+
+    reader->pos = reader->length;
+    reader->hadNewline = 0;
+
+    if(!reader->mapped) {
+        // fillReader always left room for this
+        line[*length] = 0;
+        return line;
+    }
+
+    // A mapping can't be written past its end, copy this one line out
+    free(reader->spill);
+    reader->spill = (char *) malloc(*length + 1);
+    memcpy(reader->spill, line, *length);
+    reader->spill[*length] = 0;
+
+    return reader->spill;
+}
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "xssh.h"
+
+// Sessions running at once, more connections wait in the backlog
+#define MAX_SESSIONS 64
+
+// Sent first by the client, before the strings
+#define SERVE_MAGIC 0x78737368
+
+extern char **environ;
+
+/*
+ * What a client sends: this header, then length bytes of NUL
+ * terminated strings (its cwd, the script and its args, then its
+ * environment). Its stdin, stdout and stderr come along with the
+ * header as SCM_RIGHTS.
+ */
+struct serveHeader {
+    unsigned int magic;
+    unsigned int numArgs;       /* script and args, 0 = read stdin */
+    unsigned int numEnv;
+    unsigned int length;
+};
+
+// A connection and the forked shell running its session
+struct serveSession {
+    pid_t pid;                  /* 0 = free slot */
+    int fd;
+};
+
+static struct serveSession sessions[MAX_SESSIONS];
+static int numSessions = 0;
+
+
+
+/*
+ * Fills a sockaddr_un, -1 if path doesn't fit
+ */
+static int socketAddress(struct sockaddr_un *address, char *path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+
+
+/*
+ * Reads exactly length bytes, -1 on an error or early EOF
+ */
+static int readAll(int fd, void *buffer, size_t length) {
+    size_t done = 0;
+
+    while(done < length) {
+        ssize_t count = read(fd, (char *) buffer + done, length - done);
+
+        if(count == -1 && errno == EINTR) {
+            continue;
+        }
+        if(count <= 0) {
+            return -1;
+        }
+        done += count;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Binds the listening socket. A socket file nobody answers on is left
+ * over from an old server and gets replaced.
+ */
+static int listenOn(char *path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if(socketAddress(&address, path) == -1) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return -1;
+    }
+
+    if(bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        int probe;
+
+        if(errno != EADDRINUSE) {
+            close(fd);
+            return -1;
+        }
+
+        probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(connect(probe, (struct sockaddr *) &address,
+                sizeof(address)) == 0) {
+            // Another server is already there
+            close(probe);
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        close(probe);
+
+        unlink(path);
+        if(bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+
+/*
+ * In the forked shell: takes over the client's stdin, stdout and
+ * stderr, its cwd and environment, and fills in session with the
+ * script to run. Exits if the request doesn't make sense.
+ */
+static void startSession(int fd, struct serveRequest *request) {
+    struct serveHeader header;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec part = {&header, sizeof(header)};
+    struct msghdr message;
+    struct cmsghdr *fds;
+    char *strings, *next;
+    unsigned int i;
+    int *clientFds;
+    ssize_t count;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    do {
+        count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while(count == -1 && errno == EINTR);
+
+    fds = CMSG_FIRSTHDR(&message);
+    if(count != sizeof(header) || header.magic != SERVE_MAGIC
+            || fds == NULL || fds->cmsg_type != SCM_RIGHTS
+            || fds->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        LOG(LOG_INFO, "Bad request from a client\n");
+        _exit(1);
+    }
+
+    strings = (char *) malloc(header.length + 1);
+    if(readAll(fd, strings, header.length) == -1) {
+        _exit(1);
+    }
+    strings[header.length] = 0;
+
+    clientFds = (int *) CMSG_DATA(fds);
+    for(i = 0; i < 3; ++i) {
+        dup2(clientFds[i], i);
+        close(clientFds[i]);
+    }
+
+    // Nothing else of the server's is needed in here
+    for(i = 0; i < MAX_SESSIONS; ++i) {
+        if(sessions[i].pid != 0) {
+            close(sessions[i].fd);
+        }
+    }
+    close(fd);
+
+    next = strings;
+    if(chdir(next) == -1) {
+        printf("Error: %s\n", strerror(errno));
+    }
+    next += strlen(next) + 1;
+
+    request->numArgs = (header.numArgs > MAX_ARGS ? MAX_ARGS
+            : header.numArgs);
+    for(i = 0; i < header.numArgs; ++i) {
+        if(i < MAX_ARGS) {
+            request->args[i] = next;
+        }
+        next += strlen(next) + 1;
+    }
+
+    // The client's environment, main replaces the server's with it
+    request->env = (char **) calloc(header.numEnv + 1, sizeof(char *));
+    for(i = 0; i < header.numEnv && next < strings + header.length; ++i) {
+        request->env[i] = next;
+        next += strlen(next) + 1;
+    }
+}
+
+
+
+/*
+ * Reaps finished sessions and tells their clients the exit status
+ */
+static void finishSessions() {
+    pid_t pid;
+    int status;
+    int i;
+
+    while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for(i = 0; i < MAX_SESSIONS; ++i) {
+            if(sessions[i].pid == pid) {
+                int code = (WIFEXITED(status) ? WEXITSTATUS(status)
+                        : 128 + WTERMSIG(status));
+
+                if(send(sessions[i].fd, &code, sizeof(code),
+                        MSG_NOSIGNAL) == -1) {
+                    LOG(LOG_INFO, "Client of %d went away\n", (int) pid);
+                }
+
+                close(sessions[i].fd);
+                sessions[i].pid = 0;
+                --numSessions;
+                break;
+            }
+        }
+    }
+}
+
+
+
+/*
+ * Runs the server: every connection gets a fork of this warm shell,
+ * with its own variables, so sessions never wait on each other.
+ * Only returns in the forked shell, with request filled in. Ctrl-C
+ * stops taking connections and exits once the last session is done.
+ */
+void serveClients(char *path, struct serveRequest *request) {
+    struct pollfd events[MAX_SESSIONS + 2];
+    int listenFd = listenOn(path);
+    int i;
+
+    if(listenFd == -1) {
+        printf("Can't serve on %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    LOG(LOG_INFO, "Serving on %s\n", path);
+    flushLog();
+
+    while(listenFd != -1 || numSessions > 0) {
+        struct pollfd *listening = NULL;
+        int numEvents = 0;
+
+        events[numEvents].fd = signalEventFd();
+        events[numEvents++].events = POLLIN;
+
+        if(listenFd != -1 && numSessions < MAX_SESSIONS) {
+            listening = &events[numEvents];
+            events[numEvents].fd = listenFd;
+            events[numEvents++].events = POLLIN;
+        }
+
+        // A client that hung up takes its session down with it
+        for(i = 0; i < MAX_SESSIONS; ++i) {
+            if(sessions[i].pid != 0) {
+                events[numEvents].fd = sessions[i].fd;
+                events[numEvents++].events = 0;
+            }
+        }
+
+        if(poll(events, numEvents, -1) == -1) {
+            continue;
+        }
+
+        if(events[0].revents != 0) {
+            struct signalfd_siginfo info;
+
+            while(read(events[0].fd, &info, sizeof(info)) == sizeof(info)) {
+                if(info.ssi_signo == SIGINT && listenFd != -1) {
+                    LOG(LOG_INFO, "Not taking any more connections\n");
+                    close(listenFd);
+                    unlink(path);
+                    listenFd = -1;
+                }
+            }
+            finishSessions();
+        }
+
+        for(i = 0; i < numEvents; ++i) {
+            int j;
+
+            if(&events[i] == listening || i == 0
+                    || !(events[i].revents & (POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            for(j = 0; j < MAX_SESSIONS; ++j) {
+                if(sessions[j].pid != 0 && sessions[j].fd == events[i].fd) {
+                    kill(-sessions[j].pid, SIGKILL);
+                }
+            }
+        }
+
+        if(listening != NULL && listening->revents != 0) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            pid_t pid;
+
+            if(fd == -1) {
+                continue;
+            }
+
+            flushLog();
+            pid = fork();
+
+            if(pid == 0) {
+                close(listenFd);
+                setpgid(0, 0);
+                startSession(fd, request);
+                return;
+            }
+
+            if(pid == -1) {
+                printf("Fork failed\n");
+                close(fd);
+                continue;
+            }
+
+            // Both sides, so a kill can't come before the group exists
+            setpgid(pid, pid);
+
+            for(i = 0; sessions[i].pid != 0; ++i) {
+            }
+            sessions[i].pid = pid;
+            sessions[i].fd = fd;
+            ++numSessions;
+        }
+    }
+
+    exit(0);
+}
+
+
+
+/*
+ * The client side: hands stdin, stdout, stderr, the cwd, the script
+ * and the environment to the server, then exits with the session's
+ * status
+ */
+int runClient(char *path, char *script, int numArgs, char **args) {
+    struct sockaddr_un address;
+    struct serveHeader header;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec parts[2];
+    struct msghdr message;
+    struct cmsghdr *fds;
+    char cwd[PATH_MAX];
+    char *strings, *next;
+    size_t length;
+    int fd, code, i;
+
+    if(socketAddress(&address, path) == -1
+            || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+            || connect(fd, (struct sockaddr *) &address,
+                    sizeof(address)) == -1) {
+        printf("Can't reach %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if(getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+
+    header.magic = SERVE_MAGIC;
+    header.numArgs = (script[0] != 0 ? numArgs + 1 : 0);
+    header.numEnv = 0;
+    length = strlen(cwd) + 1 + strlen(script) + 1;
+    for(i = 0; i < numArgs; ++i) {
+        length += strlen(args[i]) + 1;
+    }
+    for(i = 0; environ[i] != NULL; ++i) {
+        length += strlen(environ[i]) + 1;
+        ++header.numEnv;
+    }
+
+    strings = (char *) malloc(length);
+    next = stpcpy(strings, cwd) + 1;
+    if(header.numArgs > 0) {
+        next = stpcpy(next, script) + 1;
+        for(i = 0; i < numArgs; ++i) {
+            next = stpcpy(next, args[i]) + 1;
+        }
+    }
+    for(i = 0; environ[i] != NULL; ++i) {
+        next = stpcpy(next, environ[i]) + 1;
+    }
+    header.length = next - strings;
+
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = strings;
+    parts[1].iov_len = header.length;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    fds = CMSG_FIRSTHDR(&message);
+    fds->cmsg_level = SOL_SOCKET;
+    fds->cmsg_type = SCM_RIGHTS;
+    fds->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    for(i = 0; i < 3; ++i) {
+        ((int *) CMSG_DATA(fds))[i] = i;
+    }
+
+    // Large environments may not go in one piece, the rest follows
+    length = sizeof(header) + header.length;
+    {
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+
+        if(sent == -1) {
+            printf("Error: %s\n", strerror(errno));
+            return 1;
+        }
+
+        while((size_t) sent < length) {
+            ssize_t count = send(fd, strings + (sent - sizeof(header)),
+                    length - sent, MSG_NOSIGNAL);
+
+            if(count == -1) {
+                printf("Error: %s\n", strerror(errno));
+                return 1;
+            }
+            sent += count;
+        }
+    }
+    free(strings);
+
+    if(readAll(fd, &code, sizeof(code)) == -1) {
+        printf("Error: the server ended the session\n");
+        return 1;
+    }
+
+    close(fd);
+    return code;
+}
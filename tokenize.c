@@ -0,0 +1,244 @@
+#include <pthread.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "xssh.h"
+
+/*
+ * Splits lines into words in one pass. The bytes that matter are
+ * found 16 or 32 at a time with byte compares: spaces, tabs and
+ * newlines end a word, # starts a comment, $( and ) nest a command
+ * substitution. Everything else is skipped over without looking at it
+ * one byte at a time. x86-64 always has SSE2, other CPUs scan a
+ * byte at a time.
+ */
+
+// Finds the first byte at or after pos that a word could end on
+typedef size_t (*specialScan)(const char *line, size_t pos, size_t length);
+
+static specialScan findSpecial;
+static int tokenizerKind = -1;
+static pthread_once_t tokenizerPicked = PTHREAD_ONCE_INIT;
+
+
+
+/*
+ * Whether c is one of the bytes the scans stop on
+ */
+static inline int isSpecial(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '#' || c == '$'
+            || c == ')';
+}
+
+
+
+/*
+ * The scan one byte at a time, for CPUs without the vector ones and
+ * for the tail of a line they leave
+ */
+static size_t scanScalar(const char *line, size_t pos, size_t length) {
+    while(pos < length && !isSpecial(line[pos])) {
+        ++pos;
+    }
+
+    return pos;
+}
+
+
+
+#if defined(__x86_64__)
+
+/*
+ * 16 bytes at a time. SSE2 is always there on x86-64.
+ */
+static size_t scanSse2(const char *line, size_t pos, size_t length) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i close = _mm_set1_epi8(')');
+
+    for(; pos + 16 <= length; pos += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (line + pos));
+        __m128i found = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, space),
+                    _mm_cmpeq_epi8(bytes, tab)),
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, newline),
+                        _mm_cmpeq_epi8(bytes, hash)),
+                    _mm_or_si128(_mm_cmpeq_epi8(bytes, dollar),
+                        _mm_cmpeq_epi8(bytes, close))));
+        int mask = _mm_movemask_epi8(found);
+
+        if(mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+
+    return scanScalar(line, pos, length);
+}
+
+
+
+/*
+ * 32 bytes at a time, only called when the CPU says it has AVX2
+ */
+__attribute__((target("avx2")))
+static size_t scanAvx2(const char *line, size_t pos, size_t length) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i hash = _mm256_set1_epi8('#');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i close = _mm256_set1_epi8(')');
+
+    for(; pos + 32 <= length; pos += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (line + pos));
+        __m256i found = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(bytes, space),
+                    _mm256_cmpeq_epi8(bytes, tab)),
+                _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(bytes, newline),
+                        _mm256_cmpeq_epi8(bytes, hash)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(bytes, dollar),
+                        _mm256_cmpeq_epi8(bytes, close))));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(found);
+
+        if(mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+    }
+
+    // gcc doesn't clear the upper halves before a tail call, and SSE
+    // code after AVX code that didn't is very slow
+    _mm256_zeroupper();
+    return scanSse2(line, pos, length);
+}
+
+#endif
+
+
+
+/*
+ * Picks the scan to use. SSE2 on x86-64: the scan runs once per word,
+ * and most words are shorter than the 32 bytes AVX2 needs, so it
+ * doesn't win on real lines (make bench, tokenize_*_MBps). AVX2 is
+ * there for the benchmarks to compare.
+ */
+static void pickTokenizer() {
+    // Unless the benchmarks picked one
+    if(findSpecial != NULL) {
+        return;
+    }
+
+#if defined(__x86_64__)
+    useTokenizer(TOKENIZER_SSE2);
+#else
+    useTokenizer(TOKENIZER_SCALAR);
+#endif
+}
+
+
+
+/*
+ * Makes the tokenizer use one kind of scan, for the benchmarks.
+ * Returns -1 if this CPU can't run it.
+ */
+int useTokenizer(int kind) {
+    switch(kind) {
+        case TOKENIZER_SCALAR:
+            findSpecial = scanScalar;
+            break;
+#if defined(__x86_64__)
+        case TOKENIZER_SSE2:
+            findSpecial = scanSse2;
+            break;
+        case TOKENIZER_AVX2:
+            __builtin_cpu_init();
+            if(!__builtin_cpu_supports("avx2")) {
+                return -1;
+            }
+            findSpecial = scanAvx2;
+            break;
+#endif
+        default:
+            return -1;
+    }
+
+    tokenizerKind = kind;
+    return 0;
+}
+
+
+
+/*
+ * The kind of scan in use
+ */
+int currentTokenizer() {
+    pthread_once(&tokenizerPicked, pickTokenizer);
+    return tokenizerKind;
+}
+
+
+
+/*
+ * Finds the words of a line of length bytes, at most max of them, and
+ * puts where each starts and how long it is into tokens. A $(...) is
+ * one word up to its matching ), spaces, # and all. A # outside of
+ * one starts a comment, which runs to the end of the line.
+ * Returns how many words there are.
+ */
+int tokenizeLine(const char *line, size_t length, struct token *tokens,
+        int max) {
+    size_t pos = 0;
+    int count = 0;
+
+    // -P scripts may get here at the same time
+    pthread_once(&tokenizerPicked, pickTokenizer);
+
+    while(count < max) {
+        size_t start;
+        int depth = 0;
+        int comment = 0;
+
+        while(pos < length && (line[pos] == ' ' || line[pos] == '\t'
+                || line[pos] == '\n')) {
+            ++pos;
+        }
+        if(pos == length || line[pos] == '#') {
+            break;
+        }
+
+        start = pos;
+        while((pos = findSpecial(line, pos, length)) < length) {
+            char c = line[pos];
+
+            if(c == '$') {
+                if(pos + 1 < length && line[pos + 1] == '(') {
+                    ++depth;
+                    ++pos;
+                }
+            } else if(c == ')') {
+                if(depth > 0) {
+                    --depth;
+                }
+            } else if(depth == 0) {
+                comment = (c == '#');
+                break;
+            }
+            ++pos;
+        }
+
+        tokens[count].start = (unsigned int) start;
+        tokens[count].length = (unsigned int) (pos - start);
+        ++count;
+
+        if(comment) {
+            break;
+        }
+    }
+
+    return count;
+}
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "xssh.h"
+
+// Events kept in memory before they are written out in one batch
+#define TRACE_RING_SIZE 4096
+
+// Names longer than this are cut off
+#define TRACE_NAME_SIZE 64
+
+// One finished span, formatted only when the ring is flushed
+struct traceEvent {
+    char name[TRACE_NAME_SIZE];
+    const char *category;
+    double start;               /* microseconds since initTrace */
+    double duration;
+    pid_t tid;                  /* track, the shell's pid or a job's */
+    int status;                 /* wait status, -1 for none */
+    int thread;                 /* names the track instead, no span */
+};
+
+int tracing = 0;
+
+static int traceFd = -1;
+static pid_t shellPid;
+static struct timespec traceStart;
+static struct traceEvent ring[TRACE_RING_SIZE];
+static int ringHead = 0;        /* oldest event not written yet */
+static int ringCount = 0;
+static int firstEvent = 1;      /* no comma before it */
+
+// -P scripts trace from their own threads into the same ring
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Track of this thread's spans, the shell's pid on the main thread
+static __thread pid_t threadTrack = 0;
+
+
+
+/*
+ * Microseconds since the trace started
+ */
+double traceNow() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - traceStart.tv_sec) * 1e6
+            + (now.tv_nsec - traceStart.tv_nsec) / 1e3;
+}
+
+
+
+/*
+ * Microseconds since the trace started for a time taken elsewhere
+ */
+static double traceTime(struct timespec *time) {
+    return (time->tv_sec - traceStart.tv_sec) * 1e6
+            + (time->tv_nsec - traceStart.tv_nsec) / 1e3;
+}
+
+
+
+/*
+ * Writes all of buffer to the trace file
+ */
+static void writeAll(char *buffer, size_t length) {
+    size_t written = 0;
+
+    while(written < length) {
+        ssize_t count = write(traceFd, buffer + written, length - written);
+
+        if(count == -1 && errno == EINTR) {
+            continue;
+        }
+        if(count <= 0) {
+            return;
+        }
+        written += count;
+    }
+}
+
+
+
+/*
+ * Copies text into a JSON string, escaping what needs it
+ */
+static int escapeJson(char *out, const char *text) {
+    char *start = out;
+
+    for(; *text != 0; ++text) {
+        unsigned char c = *text;
+
+        if(c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if(c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+
+    *out = 0;
+    return out - start;
+}
+
+
+
+/*
+ * Formats one event as a trace-event JSON object
+ */
+static int formatEvent(char *out, struct traceEvent *event) {
+    char name[TRACE_NAME_SIZE * 6];
+    int length;
+
+    escapeJson(name, event->name);
+
+    if(event->thread) {
+        return sprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                firstEvent ? "" : ",\n", (int) shellPid, (int) event->tid,
+                name);
+    }
+
+    length = sprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+            firstEvent ? "" : ",\n", name, event->category, event->start,
+            event->duration, (int) shellPid, (int) event->tid);
+
+    if(event->status != -1) {
+        length += sprintf(out + length, ",\"args\":{\"status\":%d}",
+                event->status);
+    }
+
+    out[length++] = '}';
+    out[length] = 0;
+    return length;
+}
+
+
+
+/*
+ * Writes out every event in the ring in one go
+ */
+void flushTrace() {
+    static char batch[65536];
+    size_t used = 0;
+
+    pthread_mutex_lock(&traceLock);
+
+    while(ringCount > 0) {
+        // Room for the longest event there is
+        if(sizeof(batch) - used < TRACE_NAME_SIZE * 6 + 256) {
+            writeAll(batch, used);
+            used = 0;
+        }
+
+        used += formatEvent(batch + used, &ring[ringHead]);
+        firstEvent = 0;
+        ringHead = (ringHead + 1) % TRACE_RING_SIZE;
+        --ringCount;
+    }
+
+    writeAll(batch, used);
+    pthread_mutex_unlock(&traceLock);
+}
+
+
+
+/*
+ * Takes the next free event in the ring, flushing it when it's full.
+ * Called with traceLock held.
+ */
+static struct traceEvent *nextEvent() {
+    struct traceEvent *event;
+
+    while(ringCount == TRACE_RING_SIZE) {
+        pthread_mutex_unlock(&traceLock);
+        flushTrace();
+        pthread_mutex_lock(&traceLock);
+    }
+
+    event = &ring[(ringHead + ringCount) % TRACE_RING_SIZE];
+    ++ringCount;
+
+    return event;
+}
+
+
+
+/*
+ * Records a span that started at start (traceNow) and ends now.
+ * tid 0 puts it on the track of the thread running it.
+ */
+void traceSpan(const char *category, const char *name, double start,
+        pid_t tid, int status) {
+    struct traceEvent *event;
+
+    if(!tracing) {
+        return;
+    }
+
+    pthread_mutex_lock(&traceLock);
+
+    event = nextEvent();
+    strncpy(event->name, name, TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = 0;
+    event->category = category;
+    event->start = start;
+    event->duration = traceNow() - start;
+    event->tid = (tid == 0 ? (threadTrack != 0 ? threadTrack : shellPid)
+            : tid);
+    event->status = status;
+    event->thread = 0;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+
+
+/*
+ * Records a job nobody waited on in the foreground on a track of its
+ * own, keyed by its process group (or its last stage's pid)
+ */
+void traceJob(struct job *job) {
+    pid_t tid = (job->pgid != 0 ? job->pgid : job->lastPid);
+    struct traceEvent *event;
+
+    if(!tracing) {
+        return;
+    }
+
+    pthread_mutex_lock(&traceLock);
+
+    event = nextEvent();
+    snprintf(event->name, TRACE_NAME_SIZE, "[%d] %s", job->id,
+            job->command != NULL ? job->command : "");
+    event->tid = tid;
+    event->thread = 1;
+
+    event = nextEvent();
+    strncpy(event->name, job->command != NULL ? job->command : "job",
+            TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = 0;
+    event->category = "job";
+    event->start = traceTime(&job->start);
+    event->duration = traceTime(&job->end) - event->start;
+    event->tid = tid;
+    event->status = job->status;
+    event->thread = 0;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+
+
+/*
+ * Gives the calling thread a track of its own named name, for the
+ * spans of a -P script
+ */
+void traceThread(const char *name) {
+    struct traceEvent *event;
+
+    threadTrack = (pid_t) syscall(SYS_gettid);
+
+    if(!tracing) {
+        return;
+    }
+
+    pthread_mutex_lock(&traceLock);
+
+    event = nextEvent();
+    strncpy(event->name, name, TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = 0;
+    event->tid = threadTrack;
+    event->thread = 1;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+
+
+/*
+ * Closes the JSON array and the file when the shell exits
+ */
+static void closeTrace() {
+    flushTrace();
+    writeAll("\n]\n", 3);
+    close(traceFd);
+    tracing = 0;
+}
+
+
+
+/*
+ * Starts writing a Chrome trace-event file (chrome://tracing or
+ * Perfetto can open it) to path
+ */
+int initTrace(char *path) {
+    struct traceEvent *event;
+
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(traceFd == -1) {
+        return -1;
+    }
+
+    shellPid = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    tracing = 1;
+
+    writeAll("[\n", 2);
+
+    event = nextEvent();
+    strcpy(event->name, "xssh");
+    event->tid = shellPid;
+    event->thread = 1;
+
+    atexit(closeTrace);
+    return 0;
+}
@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xssh.h"
+
+// cat copies in chunks of this size
+#define CAT_BUFFER_SIZE 65536
+
+
+
+/*
+ * echo [-n] words...
+ */
+int echoUtility(struct interpreter *shell, char **args, int argCount) {
+    int newline = 1;
+    int i = 1;
+
+    if(argCount > 1 && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        ++i;
+    }
+
+    for(; i < argCount; ++i) {
+        fputs(args[i], shell->out);
+        if(i + 1 < argCount) {
+            fputc(' ', shell->out);
+        }
+    }
+
+    if(newline) {
+        fputc('\n', shell->out);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * pwd
+ */
+int pwdUtility(struct interpreter *shell, char **args, int argCount) {
+    char path[PATH_MAX];
+
+    if(currentDirectory(shell, path, sizeof(path)) == NULL) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fprintf(shell->out, "%s\n", path);
+    return 0;
+}
+
+
+
+/*
+ * sleep number[smhd]... , the times add up. Children are still reaped
+ * and Ctrl-C still works while the shell sleeps.
+ */
+int sleepUtility(struct interpreter *shell, char **args, int argCount) {
+    double total = 0;
+    int i;
+
+    if(argCount < 2) {
+        fprintf(stderr, "sleep: missing operand\n");
+        return 1;
+    }
+
+    for(i = 1; i < argCount; ++i) {
+        char *end;
+        double seconds = strtod(args[i], &end);
+
+        if(end == args[i] || seconds < 0) {
+            fprintf(stderr, "sleep: invalid time interval '%s'\n", args[i]);
+            return 1;
+        }
+
+        switch(*end) {
+            case 'd': seconds *= 24;        // fall through
+            case 'h': seconds *= 60;        // fall through
+            case 'm': seconds *= 60;        // fall through
+            case 's': ++end;                // fall through
+            default: break;
+        }
+
+        if(*end != 0) {
+            fprintf(stderr, "sleep: invalid time interval '%s'\n", args[i]);
+            return 1;
+        }
+
+        total += seconds;
+    }
+
+    // Interrupted, like a program killed by SIGINT
+    return (pauseShell(&shell->jobs, total) ? 130 : 0);
+}
+
+
+
+/*
+ * Copies fd to the shell's output. Output with no fd of its own, like
+ * a $(...), goes through the FILE.
+ */
+static int copyFile(struct interpreter *shell, int fd, char *name) {
+    char buffer[CAT_BUFFER_SIZE];
+    int out = fileno(shell->out);
+    ssize_t count;
+
+    while((count = read(fd, buffer, sizeof(buffer))) != 0) {
+        ssize_t written = 0;
+
+        if(count == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            return 1;
+        }
+
+        if(out == -1) {
+            if(fwrite(buffer, 1, count, shell->out) < (size_t) count) {
+                fprintf(stderr, "cat: write error\n");
+                return 1;
+            }
+            continue;
+        }
+
+        while(written < count) {
+            ssize_t result = write(out, buffer + written, count - written);
+
+            if(result == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "cat: write error: %s\n", strerror(errno));
+                return 1;
+            }
+            written += result;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * cat [file]... , - or no files at all is the input
+ */
+int catUtility(struct interpreter *shell, char **args, int argCount) {
+    int status = 0;
+    int i;
+
+    // Straight to the fd from here, anything buffered goes first
+    fflush(shell->out);
+
+    if(argCount < 2) {
+        return copyFile(shell, shell->in, "-");
+    }
+
+    for(i = 1; i < argCount; ++i) {
+        int fd;
+
+        if(strcmp(args[i], "-") == 0) {
+            status |= copyFile(shell, shell->in, "-");
+            continue;
+        }
+
+        fd = openat(shell->cwd, args[i], O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        status |= copyFile(shell, fd, args[i]);
+        close(fd);
+    }
+
+    return status;
+}
+
+
+
+/*
+ * Parses an integer operand of test, -1 with a message if it isn't one
+ */
+static int testInteger(char *text, long *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtol(text, &end, 10);
+
+    if(end == text || *end != 0 || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", text);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * test's unary operators on files and strings, files are looked up
+ * from the directory dir
+ */
+static int testUnary(int dir, char *op, char *operand) {
+    struct stat info;
+
+    if(strcmp(op, "-z") == 0) {
+        return operand[0] == 0;
+    }
+    if(strcmp(op, "-n") == 0) {
+        return operand[0] != 0;
+    }
+    if(strcmp(op, "-r") == 0) {
+        return faccessat(dir, operand, R_OK, 0) == 0;
+    }
+    if(strcmp(op, "-w") == 0) {
+        return faccessat(dir, operand, W_OK, 0) == 0;
+    }
+    if(strcmp(op, "-x") == 0) {
+        return faccessat(dir, operand, X_OK, 0) == 0;
+    }
+    if(strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+        return fstatat(dir, operand, &info, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISLNK(info.st_mode);
+    }
+
+    if(op[0] != '-' || op[1] == 0 || op[2] != 0
+            || strchr("efdsp", op[1]) == NULL) {
+        return -1;
+    }
+
+    if(fstatat(dir, operand, &info, 0) == -1) {
+        return 0;
+    }
+
+    switch(op[1]) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(info.st_mode);
+        case 'd': return S_ISDIR(info.st_mode);
+        case 's': return info.st_size > 0;
+        case 'p': return S_ISFIFO(info.st_mode);
+        default: return -1;
+    }
+}
+
+
+
+/*
+ * test's binary operators on strings and integers
+ */
+static int testBinary(char *left, char *op, char *right) {
+    static const char *intOps[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    long a, b;
+    int i;
+
+    if(strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    }
+    if(strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    }
+
+    for(i = 0; i < 6 && strcmp(op, intOps[i]) != 0; ++i) {
+    }
+    if(i == 6) {
+        return -1;
+    }
+
+    if(testInteger(left, &a) == -1 || testInteger(right, &b) == -1) {
+        return -2;
+    }
+
+    switch(i) {
+        case 0: return a == b;
+        case 1: return a != b;
+        case 2: return a < b;
+        case 3: return a <= b;
+        case 4: return a > b;
+        default: return a >= b;
+    }
+}
+
+
+
+/*
+ * Evaluates a test expression of up to four words, with ! in front.
+ * Returns 1 for true, 0 for false, -1 for a bad expression and -2
+ * when that was already reported.
+ */
+static int testExpression(int dir, char **args, int count) {
+    int result;
+
+    if(count > 0 && strcmp(args[0], "!") == 0 && count != 3) {
+        result = testExpression(dir, args + 1, count - 1);
+        return (result < 0 ? result : !result);
+    }
+
+    switch(count) {
+        case 0: return 0;
+        case 1: return args[0][0] != 0;
+        case 2: return testUnary(dir, args[0], args[1]);
+        case 3:
+            result = testBinary(args[0], args[1], args[2]);
+            if(result == -1 && strcmp(args[0], "!") == 0) {
+                result = testExpression(dir, args + 1, 2);
+                return (result < 0 ? result : !result);
+            }
+            return result;
+        default: return -1;
+    }
+}
+
+
+
+/*
+ * test expression, or [ expression ]
+ * Exits 0 when it's true, 1 when it's false, 2 when it makes no sense.
+ */
+int testUtility(struct interpreter *shell, char **args, int argCount) {
+    int result;
+
+    if(strcmp(args[0], "[") == 0) {
+        if(strcmp(args[argCount - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        --argCount;
+    }
+
+    result = testExpression(shell->cwd, args + 1, argCount - 1);
+
+    if(result == -1) {
+        fprintf(stderr, "%s: bad expression\n", args[0]);
+    }
+
+    return (result < 0 ? 2 : !result);
+}
@@ -0,0 +1,418 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xssh.h"
+
+// Table starts with this many slots, always a power of two
+#define VAR_TABLE_MIN_CAPACITY 16
+
+
+// Name set starts with this many buckets, always a power of two
+#define NAME_SET_MIN_CAPACITY 64
+
+// One interned name, kept while some variable in the set's tables has it
+struct internedName {
+    struct internedName *next;  /* in its bucket */
+    unsigned int hash;
+    unsigned int refs;          /* variables with this name */
+    char text[];
+};
+
+// Marks a slot whose variable was unset. Probing keeps walking past it,
+// inserting can reuse it.
+static struct variableHashStruct deletedVar;
+#define DELETED_VAR (&deletedVar)
+
+
+
+/*
+ * FNV-1a hash of a variable name
+ */
+static unsigned int hashVarId(const char *id) {
+    unsigned int hash = 2166136261u;
+
+    while(*id) {
+        hash ^= (unsigned char) *id++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Doubles the name set's buckets, rehashing from the cached hashes
+ */
+static void growNameSet(struct nameSet *names) {
+    struct internedName **oldBuckets = names->buckets;
+    unsigned int oldCapacity = names->capacity;
+    unsigned int i;
+
+    names->capacity = (oldCapacity == 0 ? NAME_SET_MIN_CAPACITY
+            : oldCapacity * 2);
+    names->buckets = (struct internedName **) calloc(names->capacity,
+            sizeof(struct internedName *));
+
+    for(i = 0; i < oldCapacity; ++i) {
+        struct internedName *name = oldBuckets[i];
+
+        while(name != NULL) {
+            struct internedName *next = name->next;
+            unsigned int bucket = name->hash & (names->capacity - 1);
+
+            name->next = names->buckets[bucket];
+            names->buckets[bucket] = name;
+            name = next;
+        }
+    }
+
+    free(oldBuckets);
+}
+
+
+
+/*
+ * The set's copy of a name, made the first time the name is seen.
+ * Each call takes a reference, releaseName gives it back.
+ */
+static const char *internName(struct nameSet *names, const char *id,
+        unsigned int hash) {
+    struct internedName *name;
+    size_t length;
+
+    if(names->count >= names->capacity) {
+        growNameSet(names);
+    }
+
+    for(name = names->buckets[hash & (names->capacity - 1)]; name != NULL;
+            name = name->next) {
+        if(name->hash == hash && strcmp(name->text, id) == 0) {
+            ++name->refs;
+            return name->text;
+        }
+    }
+
+    length = strlen(id) + 1;
+    name = (struct internedName *) malloc(sizeof(struct internedName)
+            + length);
+    memcpy(name->text, id, length);
+    name->hash = hash;
+    name->refs = 1;
+    name->next = names->buckets[hash & (names->capacity - 1)];
+    names->buckets[hash & (names->capacity - 1)] = name;
+    ++names->count;
+
+    return name->text;
+}
+
+
+
+/*
+ * Gives back a reference to an interned name, the last one frees it
+ */
+static void releaseName(struct nameSet *names, const char *id) {
+    struct internedName *name = (struct internedName *)
+            (id - offsetof(struct internedName, text));
+    struct internedName **link;
+
+    if(--name->refs > 0) {
+        return;
+    }
+
+    link = &names->buckets[name->hash & (names->capacity - 1)];
+    while(*link != name) {
+        link = &(*link)->next;
+    }
+    *link = name->next;
+    --names->count;
+
+    free(name);
+}
+
+
+
+/*
+ * Sets up an empty name set, for the tables of one interpreter
+ */
+void initNameSet(struct nameSet *names) {
+    names->buckets = NULL;
+    names->capacity = 0;
+    names->count = 0;
+}
+
+
+
+/*
+ * Frees the name set. Its tables are freed first, which frees every
+ * name in it; this is just the buckets.
+ */
+void freeNameSet(struct nameSet *names) {
+    free(names->buckets);
+    initNameSet(names);
+}
+
+
+
+/*
+ * Puts value into var, inline when it's short. A long value gets a
+ * block of its own, reused while later values fit and aren't much
+ * smaller. value may point into var's old value.
+ */
+static void storeValue(struct variableHashStruct *var, const char *value) {
+    size_t length = strlen(value) + 1;
+
+    if(length <= VAR_INLINE_SIZE) {
+        memmove(var->inlineValue, value, length);
+        if(var->value != var->inlineValue) {
+            free(var->value);
+        }
+        var->value = var->inlineValue;
+        var->capacity = VAR_INLINE_SIZE;
+    } else if(length > var->capacity || length * 2 < var->capacity) {
+        char *copy = (char *) malloc(length);
+
+        memcpy(copy, value, length);
+        if(var->value != var->inlineValue) {
+            free(var->value);
+        }
+        var->value = copy;
+        var->capacity = length;
+    } else {
+        memmove(var->value, value, length);
+    }
+}
+
+
+
+/*
+ * Frees a variable and its value, and lets go of its name
+ */
+static void freeVariable(struct variableTable *table,
+        struct variableHashStruct *var) {
+    if(var->value != var->inlineValue) {
+        free(var->value);
+    }
+
+    releaseName(table->names, var->id);
+    free(var);
+}
+
+
+
+/*
+ * Sets up an empty table, its names are interned in names. Slots are
+ * only allocated once the first variable is stored.
+ */
+void initVarTable(struct variableTable *table, struct nameSet *names) {
+    table->names = names;
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+    table->deleted = 0;
+}
+
+
+
+/*
+ * Frees every variable in the table and the slot array itself.
+ */
+void freeVarTable(struct variableTable *table) {
+    unsigned int i;
+
+    for(i = 0; i < table->capacity; ++i) {
+        if(table->slots[i].var != NULL && table->slots[i].var != DELETED_VAR) {
+            freeVariable(table, table->slots[i].var);
+        }
+    }
+
+    free(table->slots);
+    initVarTable(table, table->names);
+}
+
+
+
+/*
+ * Moves every live variable into a new slot array of the given size.
+ * Only the pointers move, the variable structs themselves stay put.
+ * Deleted slots are dropped along the way.
+ */
+static void resizeVarTable(struct variableTable *table, unsigned int capacity) {
+    struct variableSlot *oldSlots = table->slots;
+    unsigned int oldCapacity = table->capacity;
+    unsigned int mask = capacity - 1;
+    unsigned int i, j;
+
+    table->slots = (struct variableSlot *) calloc(capacity,
+            sizeof(struct variableSlot));
+    table->capacity = capacity;
+    table->deleted = 0;
+
+    for(i = 0; i < oldCapacity; ++i) {
+        struct variableHashStruct *var = oldSlots[i].var;
+
+        if(var == NULL || var == DELETED_VAR) {
+            continue;
+        }
+
+        // Hash was cached, so no need to rehash the name
+        j = oldSlots[i].hash & mask;
+        while(table->slots[j].var != NULL) {
+            j = (j + 1) & mask;
+        }
+
+        table->slots[j] = oldSlots[i];
+    }
+
+    free(oldSlots);
+}
+
+
+
+/*
+ * Linear probe for the slot holding id.
+ * Returns the slot index, or -1 if id isn't in the table.
+ */
+static int findVarSlot(struct variableTable *table, const char *id,
+        unsigned int hash) {
+    unsigned int mask = table->capacity - 1;
+    unsigned int i;
+
+    if(table->capacity == 0) {
+        return -1;
+    }
+
+    for(i = hash & mask; table->slots[i].var != NULL; i = (i + 1) & mask) {
+        if(table->slots[i].var != DELETED_VAR && table->slots[i].hash == hash
+                && strcmp(table->slots[i].var->id, id) == 0) {
+            return (int) i;
+        }
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Find the variable with the given id
+ */
+struct variableHashStruct *findVar(struct variableTable *table,
+        const char *id) {
+    int slot = findVarSlot(table, id, hashVarId(id));
+
+    return (slot == -1 ? NULL : table->slots[slot].var);
+}
+
+
+
+/*
+ * Sets id to value, creating the variable if it doesn't exist yet.
+ * Returns the stored variable.
+ */
+struct variableHashStruct *setVar(struct variableTable *table,
+        const char *id, const char *value) {
+    unsigned int hash = hashVarId(id);
+    unsigned int mask, i;
+    int slot, reuse = -1;
+    struct variableHashStruct *var;
+
+    // If the item is already in the table, edit the existing struct
+    slot = findVarSlot(table, id, hash);
+    if(slot != -1) {
+        var = table->slots[slot].var;
+        storeValue(var, value);
+        return var;
+    }
+
+    // Keep the load (live + deleted) under 3/4. If most of that is
+    // deleted slots, rebuilding at the same size is enough.
+    if((table->count + table->deleted + 1) * 4 > table->capacity * 3) {
+        unsigned int capacity = table->capacity;
+
+        if(capacity == 0) {
+            capacity = VAR_TABLE_MIN_CAPACITY;
+        } else if((table->count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+
+        resizeVarTable(table, capacity);
+    }
+
+    var = (struct variableHashStruct *)
+            malloc(sizeof(struct variableHashStruct));
+    var->id = internName(table->names, id, hash);
+    var->value = var->inlineValue;
+    var->capacity = VAR_INLINE_SIZE;
+    var->envIndex = -1;
+    storeValue(var, value);
+
+    // First deleted slot along the probe sequence gets reused
+    mask = table->capacity - 1;
+    for(i = hash & mask; table->slots[i].var != NULL; i = (i + 1) & mask) {
+        if(table->slots[i].var == DELETED_VAR) {
+            reuse = (int) i;
+            break;
+        }
+    }
+
+    if(reuse != -1) {
+        i = (unsigned int) reuse;
+        --table->deleted;
+    }
+
+    table->slots[i].hash = hash;
+    table->slots[i].var = var;
+    ++table->count;
+
+    return var;
+}
+
+
+
+/*
+ * Removes id from the table and frees its struct.
+ * Returns 0 on success, -1 if id wasn't found.
+ */
+int removeVar(struct variableTable *table, const char *id) {
+    int slot = findVarSlot(table, id, hashVarId(id));
+    unsigned int next;
+
+    if(slot == -1) {
+        return -1;
+    }
+
+    freeVariable(table, table->slots[slot].var);
+    --table->count;
+
+    // If the next slot is empty nothing probes through this one,
+    // so it can go straight back to empty
+    next = ((unsigned int) slot + 1) & (table->capacity - 1);
+    if(table->slots[next].var == NULL) {
+        table->slots[slot].var = NULL;
+    } else {
+        table->slots[slot].var = DELETED_VAR;
+        ++table->deleted;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Iterates over the live variables in the table.
+ * Start with *index = 0, returns NULL once every variable was visited.
+ */
+struct variableHashStruct *nextVar(struct variableTable *table,
+        unsigned int *index) {
+    while(*index < table->capacity) {
+        struct variableHashStruct *var = table->slots[(*index)++].var;
+
+        if(var != NULL && var != DELETED_VAR) {
+            return var;
+        }
+    }
+
+    return NULL;
+}
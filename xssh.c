@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
@@ -10,27 +12,119 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "xssh.h"
 
-// 16 + 1 for null character
-#define MAX_ARGS 17
-#define MAX_VAR_SIZE 256
-#define MAX_LINE_SIZE 256
-
-
-int foregroundPID = -1;     // PID of foreground child process
+// Starting size of the per command arena, grows to the high-water mark
+#define ARENA_SIZE 8192
+
+// Long options that have no short form
+#define OPT_METRICS_FILE 256
+#define OPT_METRICS_INTERVAL 257
+#define OPT_TRACE 258
+#define OPT_SERVE 259
+#define OPT_CLIENT 260
+#define OPT_SUBST_LIMIT 261
+
+// How external commands get started, picked with -s
+#define SPAWN_FORK 0
+#define SPAWN_VFORK 1
+#define SPAWN_POSIX 2
+#define SPAWN_ZYGOTE 3
+
+// Status for a job whose last program couldn't be started,
+// what a shell gives a command that isn't found
+#define SPAWN_FAILED_STATUS (127 << 8)
+
+// An expanded word while it's being built, in the command arena
+struct expansion {
+    char *text;
+    size_t length;
+    size_t capacity;
+};
+
+// Extra room an expansion gets when it has to grow
+#define EXPANSION_SLACK 32
+
+// What a $(...) wrote so far. Builtins write into it through a FILE,
+// programs through a pipe the shell reads.
+struct capture {
+    char *text;             // malloc'd, not NUL terminated
+    size_t length;
+    size_t capacity;
+    int overflow;           // went over substLimit, the rest was dropped
+    int readFd;             // the pipe, -1 when nothing runs as a program
+    int writeFd;            // -1 once the programs have it
+};
+
+// Chunk a $(...) pipe is read in
+#define CAPTURE_READ_SIZE 65536
+
+// One slot of a parallel block, holds a job while it runs
+struct parallelSlot {
+    struct job *job;        // NULL = slot is free
+    int order;              // position of the job in the block
+};
+
+// What one command cost, for time and -T
+struct commandCost {
+    double wall;            // seconds
+    double user;
+    double sys;
+    long maxRss;            // KB, of the biggest process
+    long voluntary;         // context switches
+    long involuntary;
+};
+
+// Where a measurement started
+struct costTimer {
+    struct timespec start;
+    struct rusage self;
+    struct rusage children;     // childUsage from outside, put back after
+};
+
+// Adds up the cost of one line of a -f script, for -T
+struct lineCost {
+    int lineNumber;
+    int runs;
+    char *text;
+    struct commandCost total;
+};
+
+// Lines shown in the -T summary
+#define MAX_COST_LINES 10
+
+// State of one parallel block while its body runs
+struct parallelRun {
+    struct interpreter *shell;
+    struct parallelSlot *slots;
+    int maxJobs;
+    int running;            // slots in use
+    int started;            // jobs started so far
+    int failedOrder;        // first job (in block order) that failed, -1 = none
+    int failedStatus;       // and its status
+};
+
+int interactive = 0;        // stdin is a terminal
+int timeLines = 0;          // -T, time every line of the -f file
 int displayCommand = 0;     // Command line arg set on start of xssh
-int numLocalVars = 8;       // Total local variables the current array can hold
-int localVarIndex = 0;      // Count of the local varables, used to index array
+int spawnMode = SPAWN_POSIX; // Spawn method for external commands
+int externalUtilities = 0;  // -E, echo, cat etc. always run the program
+size_t substLimit = 16 << 20; // --subst-limit, most a $(...) keeps
 
 
-// Array of local variables
-struct variableHashStruct **localVars;
+int pooled = 0;             // -P, scripts are running on other threads
 
 
-char *argBuffer[MAX_ARGS + 1];      // Array of command that was read in, split by word
-char *line = NULL;                  // Command string read in
-int argCount = 1;              	    // Number of args found in command
+// The shell's own variables, jobs, environment and such. -P scripts
+// each get another one.
+struct interpreter mainShell;
+
+// Reads stdin when it isn't a terminal
+struct scriptReader stdinReader;
 
 
 
@@ -44,744 +138,3014 @@ int lengthOfInt(int num) {
 
 
 /*
- * Loops through the argument buffer and deletes
- * all of the variables. Should be called each time
- * a command is processed
+ * Drops the line and everything split or substituted out of it.
+ * Should be called each time a command is processed
+ */
+void freeArgBuffer(struct interpreter *shell) {
+    resetArena(&shell->commandArena);
+    shell->line = NULL;
+}
+
+
+
+/*
+ * Sets up an interpreter with no variables, no jobs and a copy of
+ * env. byPid is for one that shares the process with others, see
+ * initJobTable.
+ */
+void initInterpreter(struct interpreter *shell, char **env, int byPid) {
+    memset(shell, 0, sizeof(struct interpreter));
+
+    initNameSet(&shell->names);
+    initVarTable(&shell->localVars, &shell->names);
+    initVarTable(&shell->commandPaths, &shell->names);
+    initEnv(&shell->env, env, !byPid, &shell->names);
+    initJobTable(&shell->jobs, byPid);
+
+    initArena(&shell->commandArena, ARENA_SIZE);
+    initArena(&shell->inputArena, ARENA_SIZE);
+    initBlockParser(&shell->inputBlocks);
+
+    shell->out = stdout;
+    shell->in = 0;
+    shell->cwd = AT_FDCWD;
+}
+
+
+
+/*
+ * Frees everything an interpreter holds. Jobs still running are
+ * forgotten about.
+ */
+void freeInterpreter(struct interpreter *shell) {
+    freeFunctions(shell);
+    freeVarTable(&shell->localVars);
+    freeVarTable(&shell->commandPaths);
+    freeEnv(&shell->env);
+    freeNameSet(&shell->names);
+    freeJobs(&shell->jobs);
+    freeArena(&shell->commandArena);
+    freeArena(&shell->inputArena);
+
+    if(shell->cwd != AT_FDCWD) {
+        close(shell->cwd);
+    }
+}
+
+
+
+/*
+ * The path of the shell's current directory, in buffer. Returns NULL
+ * with errno set if it can't be found.
+ */
+char *currentDirectory(struct interpreter *shell, char *buffer, size_t size) {
+    char link[64];
+    ssize_t length;
+
+    if(shell->cwd == AT_FDCWD) {
+        return getcwd(buffer, size);
+    }
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", shell->cwd);
+    length = readlink(link, buffer, size - 1);
+    if(length == -1) {
+        return NULL;
+    }
+
+    buffer[length] = 0;
+    return buffer;
+}
+
+
+
+/*
+ * path as the shell sees it, for what only takes a path. A relative
+ * one in a -P script's own directory gets that directory's path in
+ * front, in buffer (PATH_MAX).
  */
-void freeArgBuffer() {
-    int k;
+static char *shellPath(struct interpreter *shell, char *path,
+        char *buffer) {
+    char directory[PATH_MAX];
+
+    if(shell->cwd == AT_FDCWD || path[0] == '/') {
+        return path;
+    }
+
+    if(currentDirectory(shell, directory, sizeof(directory)) == NULL) {
+        return path;
+    }
 
-    for(k = 0; k < argCount; ++k) {
-        free(argBuffer[k]);
+    if(snprintf(buffer, PATH_MAX, "%s/%s", directory, path) >= PATH_MAX) {
+        return path;
     }
+
+    return buffer;
 }
 
 
+
 /*
  * Called right before exiting the program.
- * It frees each local var struct and then it frees
- * the array holding the local vars.
+ * Frees each local var struct, the table holding them and the names.
  */
 void freeLocalVar() {
-    int j;
+    freeInterpreter(&mainShell);
+}
+
+
+
+/*
+ * Find the local variable that matches the id that is passed in
+ */
+struct variableHashStruct * findLocalVar(struct interpreter *shell,
+        char * id) {
+    struct variableHashStruct *var = findVar(&shell->localVars, id);
 
-    // Free all local variables
-    for(j = 0; j < localVarIndex; ++j) {
-        free(localVars[j]);
+    ++metrics.varLookups;
+    if(var == NULL) {
+        ++metrics.varMisses;
     }
 
-    free(localVars);
+    return var;
 }
 
 
 
 /*
- * Find the struct in the localVars array that
- * matches the id that is passed in
+ * Creates or updates the local variable id.
+ * The table copies both strings.
  */
-struct variableHashStruct * findLocalVar(char * id) {
-    int i;
+void setLocalVar(struct interpreter *shell, char* id, char* value) {
+    setVar(&shell->localVars, id, value);
+}
+
+
+
+/*
+ * Points the child's stdin/stdout at its pipe ends and redirect files.
+ * Only called in a forked or vforked child before exec (or one the
+ * zygote started).
+ * Returns -1 with errno set if a redirect file can't be opened.
+ */
+int setupChildFds(struct spawnRequest *request) {
+    resetChildSignals();
+
+    if(request->background) {
+        // Put the child into the background (into a diff process group)
+        setpgid(0, request->pgid);
+    }
 
-    // Find local var
-    for(i = 0; i < localVarIndex; ++i) {
-        if(strcmp(id, localVars[i]->id) == 0) {
-            return localVars[i];
+    // A -P script's own directory, before the < and > files
+    if(request->cwd != AT_FDCWD && fchdir(request->cwd) == -1) {
+        return -1;
+    }
+
+    if(request->inFd != -1) {
+        dup2(request->inFd, 0);
+    }
+
+    if(request->outFd != -1) {
+        dup2(request->outFd, 1);
+    }
+
+    // Check if there is a file: <
+    if(request->fileIn != NULL) {
+        int fd = open(request->fileIn, O_RDONLY);
+
+        if(fd == -1) {
+            return -1;
         }
+        dup2(fd, 0);   // make stdin come from file
+        close(fd);
     }
 
-    return NULL;
+    // Check if there is a file: >
+    if(request->fileOut != NULL) {
+        int fd = open(request->fileOut, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+
+        if(fd == -1) {
+            return -1;
+        }
+        dup2(fd, 1);    // make stdout go to file
+        close(fd);
+    }
+
+    return 0;
 }
 
 
 
 /*
- * Mallocs space to hold the struct for the
- * new local variable. The localVar array is then
- * given a pointer to this new variable to hold.
+ * Classic fork + exec. The child gets a full copy of the shell
+ * before it execs, so this gets slower as the shell grows.
  */
-void setLocalVar(char* id, char* value) {
-    int i;
-    struct variableHashStruct *var;
+static pid_t spawnWithFork(char *path, struct spawnRequest *request) {
+    pid_t childPID;
 
-    // If the item is already in the array
-    var = findLocalVar(id);
-    if(var != NULL) {
-        // edit the existing struct
-        strncpy(var->value, value, MAX_VAR_SIZE);
-        return;
-    } else {
-        // Malloc space for the new var
-        var = (struct variableHashStruct *)
-                malloc(sizeof(struct variableHashStruct));
+    // Don't let the child flush a second copy of our buffered output
+    fflush(stdout);
+    flushLog();
+
+    childPID = fork();
+
+    if(childPID == -1) {
+        // Fork failed
+        printf("Fork failed\n");
+        return -1;
+    }
+
+    if(childPID == 0) {
+        // child process
+        // _exit so the shell's atexit handlers (-T, the metrics file)
+        // don't run again in here
+        if(setupChildFds(request) == -1) {
+            printf("Error: %s\n", strerror(errno));
+            fflush(stdout);
+            _exit(1);
+        }
+
+        execve(path, request->args, request->env);
 
-        strncpy(var->id, id, MAX_VAR_SIZE);
-        strncpy(var->value, value, MAX_VAR_SIZE);
+        // Exec couldn't execute the commands
+        printf("Error: %s\n", strerror(errno));
+        fflush(stdout);
+        _exit(0);
     }
 
-    // If we're out of space in the local var array
-    if(localVarIndex >= numLocalVars) {
-        // Resize (double) the local var array
-        struct variableHashStruct **tmp = localVars;
+    return childPID;
+}
+
 
-        numLocalVars *= 2;
-        localVars = (struct variableHashStruct **) malloc(sizeof(struct
-                variableHashStruct *) * numLocalVars);
 
-        // Copy over the elements
-        for(i = 0; i < localVarIndex; ++i) {
-            localVars[i] = tmp[i];
+/*
+ * vfork + exec. The child borrows the shell's memory until it execs,
+ * so nothing gets copied. The child may only touch local state and
+ * reports a failure back through childErrno before _exit-ing.
+ * Returns -1 with errno set if the child couldn't exec.
+ */
+static pid_t spawnWithVfork(char *path, struct spawnRequest *request) {
+    volatile int childErrno = 0;
+    pid_t childPID = vfork();
+
+    if(childPID == -1) {
+        printf("Fork failed\n");
+        return -1;
+    }
+
+    if(childPID == 0) {
+        if(setupChildFds(request) == 0) {
+            execve(path, request->args, request->env);
         }
 
-        free(tmp);
+        childErrno = errno;
+        _exit(127);
+    }
+
+    // The child has either exec'd or exited by the time vfork returns
+    if(childErrno != 0) {
+        waitpid(childPID, NULL, 0);
+        errno = childErrno;
+        return -1;
     }
 
-    localVars[localVarIndex] = var;
-    ++localVarIndex;
+    return childPID;
 }
 
 
 
 /*
- * Calls external commands with fork and exec.
- * Also handles background processes and I/O redirection
+ * posix_spawn with file actions for the pipes and redirections and
+ * a process group for background jobs.
+ * Returns -1 with errno set if the child couldn't be started.
  */
-int forkCommand(char* program, char** args, int argCount) {
+static pid_t spawnWithPosix(char *path, struct spawnRequest *request) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t signals;
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
     pid_t childPID;
-    int i, status;
-    int parentWait = 1;
-    char fileIn[MAX_VAR_SIZE];
-    char fileOut[MAX_VAR_SIZE];
-    fileIn[0] = 0;
-    fileOut[0] = 0;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // Undo what initJobs did to the shell's signals
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGTSTP);
+    sigaddset(&signals, SIGTTOU);
+    sigaddset(&signals, SIGTTIN);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
+
+    // A -P script's own directory, before the < and > files
+    if(request->cwd != AT_FDCWD) {
+        posix_spawn_file_actions_addfchdir_np(&actions, request->cwd);
+    }
 
-    // Check to see if parent should wait
-    for(i = 0; i < argCount; ++i) {
-        if(args[i][0] == '&') {
-            parentWait = 0;
-            free(args[i]);
-            args[i] = NULL;
-        }
+    // Pipe ends are close-on-exec, the dup'd copies on 0 and 1 aren't
+    if(request->inFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, request->inFd, 0);
     }
 
-    // Check for I/O redirection: < and >
-    for(i = 0; i < argCount; ++i) {
-        // Found an output file
-        if(args[i] && strcmp(args[i], ">") == 0 ) {
-            if(i+1 < argCount && args[i+1]) {
-                // there are more args, should be the file name
-                strncpy(fileOut, args[i+1], strlen(args[i+1]) + 1);
-                free(args[i+1]);
-                args[i+1] = NULL;
-            }
-            free(args[i]);
-            args[i] = NULL;
+    if(request->outFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, request->outFd, 1);
+    }
+
+    if(request->fileIn != NULL) {
+        posix_spawn_file_actions_addopen(&actions, 0, request->fileIn,
+                O_RDONLY, 0);
+    }
+
+    if(request->fileOut != NULL) {
+        posix_spawn_file_actions_addopen(&actions, 1, request->fileOut,
+                O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    }
+
+    if(request->background) {
+        // Put the child into the background (into a diff process group)
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, request->pgid);
+    }
+
+    posix_spawnattr_setflags(&attr, flags);
+
+    err = posix_spawn(&childPID, path, &actions, &attr, request->args,
+            request->env);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    return childPID;
+}
+
+
+
+/*
+ * Searches each $PATH directory for an executable called program.
+ * Writes the full path into pathBuffer and returns 0, or -1 if
+ * program isn't in any of them.
+ */
+static int searchPath(struct interpreter *shell, char *program,
+        char *pathBuffer) {
+    char *path = findEnvVar(&shell->env, "PATH");
+    char *dir, *end;
+    struct stat info;
+
+    if(path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+
+    for(dir = path; ; dir = end + 1) {
+        int dirLength;
+
+        end = strchr(dir, ':');
+        dirLength = (end == NULL ? (int) strlen(dir) : (int) (end - dir));
+
+        // An empty entry means the current directory
+        if(dirLength == 0) {
+            snprintf(pathBuffer, PATH_MAX, "%s", program);
+        } else {
+            snprintf(pathBuffer, PATH_MAX, "%.*s/%s", dirLength, dir, program);
         }
 
-        // Found an input file
-        if(args[i] && strcmp(args[i], "<") == 0) {
-            if(i+1 < argCount && args[i+1]) {
-                // there are more args, should be the file name
-                strncpy(fileIn, args[i+1], strlen(args[i+1]) + 1);
-                free(args[i+1]);
-                args[i+1] = NULL;
-            }
-            free(args[i]);
-            args[i] = NULL;
+        // Relative entries are from a -P script's own directory
+        if(faccessat(shell->cwd, pathBuffer, X_OK, 0) == 0
+                && fstatat(shell->cwd, pathBuffer, &info, 0) == 0
+                && S_ISREG(info.st_mode)) {
+            return 0;
+        }
+
+        if(end == NULL) {
+            return -1;
         }
     }
+}
 
-    childPID = fork();
 
-    if(childPID >= 0) {
-        if(childPID == 0) {
 
-            // child process
-            if(!parentWait) {
-                // Put the child into the background (into a diff process group)
-                setpgid(0, 0);
-            }
+/*
+ * Turns a program name into the path to exec.
+ * Names with a slash are used as they are, anything else is looked up
+ * in the command path cache and then in $PATH. Absolute results are
+ * cached so the next run skips the search.
+ * Returns NULL if the program can't be found.
+ */
+char *resolveCommand(struct interpreter *shell, char *program,
+        char *pathBuffer) {
+    struct variableHashStruct *cached;
 
-            // Check if string is not null, you got a file: <
-            if(fileIn != NULL && fileIn[0] != '\0') {
-                int fd = open(fileIn, O_RDONLY);
+    if(strchr(program, '/') != NULL) {
+        return program;
+    }
 
-                if(fd == -1) {
-                    printf("Error: %s\n", strerror(errno));
-                    return 1;
-                } else {
-                    dup2(fd, 0);   // make stdin come from file
-                    close(fd);
-                }
-            }
+    cached = findVar(&shell->commandPaths, program);
+    if(cached != NULL) {
+        return cached->value;
+    }
 
+    if(searchPath(shell, program, pathBuffer) == -1) {
+        return NULL;
+    }
 
-            // Check if string is not null, you got a file: >
-            if(fileOut != NULL && fileOut[0] != '\0') {
-                int fd = open(fileOut, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    // Relative $PATH entries depend on the cwd, so only cache absolute ones
+    if(pathBuffer[0] == '/') {
+        setVar(&shell->commandPaths, program, pathBuffer);
+    }
 
-                if(fd == -1) {
-                    printf("Error: %s\n", strerror(errno));
-                    freeArgBuffer();
-                    return 1;
-                } else {
-                    dup2(fd, 1);    // make stdout go to file
-                    close(fd);
+    return pathBuffer;
+}
+
+
+
+/*
+ * Forgets every cached command path. Called when $PATH changes.
+ */
+void clearCommandPaths(struct interpreter *shell) {
+    freeVarTable(&shell->commandPaths);
+}
+
+
+
+/*
+ * Whether a cached path can't be run any more, errno is left alone
+ */
+static int isStale(char *path) {
+    int error = errno;
+    int stale = (access(path, X_OK) == -1);
+
+    errno = error;
+    return stale;
+}
+
+
+
+/*
+ * Starts request->args[0] with the spawn method picked by -s.
+ * Returns the child PID, or -1 if the child couldn't be started.
+ */
+static pid_t startProgram(struct interpreter *shell,
+        struct spawnRequest *request) {
+    char *program = request->args[0];
+    char pathBuffer[PATH_MAX];
+    char *path;
+    pid_t childPID;
+    int retried = 0;
+
+    while(1) {
+        path = resolveCommand(shell, program, pathBuffer);
+
+        if(path == NULL) {
+            printf("Error: %s\n", strerror(ENOENT));
+            return -1;
+        }
+
+        switch(spawnMode) {
+            case SPAWN_FORK:
+                // The forked child can't tell us about a stale path,
+                // so check it before forking
+                if(path != program && path != pathBuffer
+                        && access(path, X_OK) == -1) {
+                    childPID = -1;
+                    break;
                 }
-            }
+                ++metrics.forks;
+                return spawnWithFork(path, request);
+            case SPAWN_VFORK:
+                ++metrics.forks;
+                childPID = spawnWithVfork(path, request);
+                break;
+            case SPAWN_ZYGOTE:
+                ++metrics.forks;
+                childPID = spawnWithZygote(path, request);
+                break;
+            default:
+                ++metrics.forks;
+                childPID = spawnWithPosix(path, request);
+                break;
+        }
 
-            if(execvp(program, args) == -1) {
-                // Exec couldn't execute the commands
-                printf("Error: %s\n", strerror(errno));
-                exit(0);
-            }
+        if(childPID != -1) {
+            return childPID;
+        }
+
+        // A cached path that went away: drop it and search $PATH again.
+        // A < or > file that can't be opened fails with the same errors,
+        // so the path itself has to be gone too.
+        if(!retried && path != program && path != pathBuffer
+                && (errno == ENOENT || errno == EACCES || errno == ENOTDIR)
+                && isStale(path)) {
+            LOG(LOG_INFO, "Dropping stale path for %s: %s\n", program, path);
+            removeVar(&shell->commandPaths, program);
+            retried = 1;
+            continue;
+        }
+
+        printf("Error: %s\n", strerror(errno));
+        return -1;
+    }
+}
 
-            //freeArgBuffer();
 
-            // Gotta stop these naughty children...
-            exit(0);
 
-        } else {
-            // parent process
-            if(parentWait) {
-                foregroundPID = childPID;
-                waitpid(childPID, &status, 0);
-                fprintf(stderr, "Child is done. Status: %d\n", status);
+/*
+ * startProgram, counted for stats, timed for the spawn latency
+ * histogram and traced
+ */
+pid_t spawnProcess(struct interpreter *shell, struct spawnRequest *request) {
+    struct timespec start, end;
+    double traceStart = (tracing ? traceNow() : 0);
+    pid_t childPID;
 
-                // Getting the status as a string
-                int lengthOfStatus = lengthOfInt(status);
-                char statusBuffer[lengthOfStatus + 1];
-                sprintf(statusBuffer, "%d", status);
-                setLocalVar("?", statusBuffer);
+    // Output of builtins before this goes first
+    fflush(stdout);
+    fflush(shell->out);
 
-                foregroundPID = -1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    childPID = startProgram(shell, request);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-            } else {
-                // Getting the pid as a string
-                int lengthOfPID = lengthOfInt(childPID);
-                char pidBuffer[lengthOfPID + 1];
-                sprintf(pidBuffer, "%d", childPID);
-                setLocalVar("!", pidBuffer);
-            }
+    countSpawn(childPID != -1, (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9);
+    traceSpan("spawn", request->args[0], traceStart, 0,
+            childPID == -1 ? SPAWN_FAILED_STATUS : -1);
+
+    return childPID;
+}
+
+
+
+/*
+ * Runs a builtin stage of a pipeline in the shell itself.
+ * Its output goes into outFd (closed afterwards) instead of stdout.
+ * Returns 1 without running it if outFd can't be written through.
+ */
+static int runBuiltinStage(struct interpreter *shell, int opcode,
+        char **args, int argCount, int outFd) {
+    FILE *savedOut = shell->out;
+    void (*savedPipe)(int) = SIG_IGN;
+
+    if(outFd != -1) {
+        shell->out = fdopen(outFd, "w");
+        if(shell->out == NULL) {
+            printf("Error: %s\n", strerror(errno));
+            close(outFd);
+            shell->out = savedOut;
+            return 1;
         }
-    } else {
-        // Fork failed
-        printf("Fork failed\n");
-        return 1;
     }
+
+    // A reader that quit early shouldn't take the shell down with it.
+    // With -P it's ignored the whole time, the threads would race.
+    if(!pooled) {
+        savedPipe = signal(SIGPIPE, SIG_IGN);
+    }
+
+    runBuiltin(shell, opcode, args, argCount);
+
+    if(shell->out != savedOut) {
+        fclose(shell->out);
+        shell->out = savedOut;
+    }
+
+    if(!pooled) {
+        signal(SIGPIPE, savedPipe);
+    }
+
     return 0;
 }
 
 
 
 /*
- * Processes the string read in from the command line.
- * Splits the string into an array of pointers to strings.
- * Each word in teh command becomes an individual element.
- *
- * Comments (#) are ignored.
+ * Whether a command has to be started as a program. A utility only
+ * runs in the shell as a foreground command of its own, outside of
+ * parallel blocks and without -E.
  */
-void splitCommand(char* line, int *argCount) {
-    // Tokenize the input
-    const char* delim = " \t\x09\xA";
-    char *program;
-    char *arguments;
-    char* arg;
-    int j;
+static int isProgram(struct command *command, int inParallel) {
+    if(command->opcode == OP_EXTERNAL || command->pipeNext != NULL) {
+        return 1;
+    }
+
+    return builtins[command->opcode].utility
+            && (externalUtilities || command->background || inParallel);
+}
+
+
+
+/*
+ * Sets $? to a wait status
+ */
+static void setStatusVar(struct interpreter *shell, int status) {
+    // Getting the status as a string
+    int lengthOfStatus = lengthOfInt(status);
+    char statusBuffer[lengthOfStatus + 1];
+    sprintf(statusBuffer, "%d", status);
+    setLocalVar(shell, "?", statusBuffer);
+}
+
+
+
+/*
+ * Adds size bytes to a capture, up to substLimit. Past that the rest
+ * is dropped and 0 is returned, a write error for whoever wrote it.
+ */
+static ssize_t writeCapture(void *cookie, const char *data, size_t size) {
+    struct capture *capture = (struct capture *) cookie;
+
+    if(capture->length + size > substLimit) {
+        capture->overflow = 1;
+        size = substLimit - capture->length;
+        if(size == 0) {
+            return 0;
+        }
+    }
+
+    if(capture->length + size > capture->capacity) {
+        capture->capacity = (capture->capacity == 0 ? CAPTURE_READ_SIZE
+                : capture->capacity * 2);
+        if(capture->capacity < capture->length + size) {
+            capture->capacity = capture->length + size;
+        }
+        capture->text = (char *) realloc(capture->text, capture->capacity);
+    }
+
+    memcpy(capture->text + capture->length, data, size);
+    capture->length += size;
+
+    return size;
+}
+
+
+
+/*
+ * Opens the pipe programs write into a capture through, if it isn't
+ * open already. It stays open until readCapture.
+ */
+static void openCapture(struct capture *capture) {
+    int ends[2];
 
-    // Check if the line is commented out
-    if(line[0] == '#') {
-        *argCount = 0;
-        argBuffer[0] = 0;
+    if(capture->readFd != -1 || pipe2(ends, O_CLOEXEC) == -1) {
         return;
     }
 
-    program = strtok(line, delim);
+    capture->readFd = ends[0];
+    capture->writeFd = ends[1];
+}
+
 
-    if(program == NULL || program[0] == '\0' || strcmp(program, "") == 0) {
-        *argCount = 0;
-        argBuffer[0] = 0;
+
+/*
+ * Reads a $(...) pipe into its capture until every program is done
+ * with it. Once substLimit is reached the pipe is closed, so a
+ * runaway program gets SIGPIPE instead of filling up the shell.
+ */
+static void readCapture(struct capture *capture) {
+    char buffer[CAPTURE_READ_SIZE];
+    ssize_t count;
+
+    if(capture->readFd == -1) {
         return;
     }
 
-    // Remove new line characters
-    char *newline = strchr(program, '\n');
-    if (newline) {
-        *newline = 0;
+    // Only the programs hold the other end now, EOF is when they're done
+    if(capture->writeFd != -1) {
+        close(capture->writeFd);
+        capture->writeFd = -1;
+    }
+
+    while((count = read(capture->readFd, buffer, sizeof(buffer))) != 0) {
+        if(count == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if((size_t) writeCapture(capture, buffer, count) < (size_t) count) {
+            break;
+        }
     }
 
-    // Cut off line after a "#"
-    char *commented = strchr(program, '#');
-    if (commented) {
-        *commented = 0;
-    }
+    close(capture->readFd);
+    capture->readFd = -1;
+}
+
+
+
+/*
+ * The command line of a job, for jobs to show
+ */
+static char *jobText(struct spawnRequest *stages, int numStages,
+        int background) {
+    size_t length = 3;
+    char *text;
+    int i, j;
+
+    for(i = 0; i < numStages; ++i) {
+        for(j = 0; j < stages[i].argCount; ++j) {
+            length += strlen(stages[i].args[j]) + 1;
+        }
+        length += 2;
+    }
+
+    text = (char *) malloc(length);
+    text[0] = 0;
+
+    for(i = 0; i < numStages; ++i) {
+        if(i > 0) {
+            strcat(text, " | ");
+        }
+
+        for(j = 0; j < stages[i].argCount; ++j) {
+            if(j > 0) {
+                strcat(text, " ");
+            }
+            strcat(text, stages[i].args[j]);
+        }
+    }
+
+    if(background) {
+        strcat(text, " &");
+    }
+
+    return text;
+}
+
+
+
+/*
+ * Starts every stage of a pipeline without waiting on any of them.
+ * The stages are connected with close-on-exec pipes, builtin stages
+ * run in the shell itself once the external stages are up.
+ * Returns the job for the stages that are running, NULL when nothing
+ * is left to wait for. *status gets the pipeline's status if it
+ * finished already, because the last stage was a builtin or couldn't
+ * be started.
+ */
+static struct job *startPipeline(struct interpreter *shell,
+        struct command *pipeline, int *status) {
+    struct spawnRequest stages[MAX_ARGS];
+    int opcodes[MAX_ARGS];
+    int pipes[MAX_ARGS][2];
+    char path[PATH_MAX];
+    struct command *stage;
+    struct job *job;
+    int numStages = 0;
+    pid_t pgid = 0;
+    double start;
+    int failed = 0;
+    int i;
+
+    *status = 0;
+    start = (tracing ? traceNow() : 0);
+
+    for(stage = pipeline; stage != NULL; stage = stage->pipeNext) {
+        struct spawnRequest *request = &stages[numStages];
+
+        // Utilities in a pipeline are the real programs
+        opcodes[numStages] = (builtins[stage->opcode].utility ? OP_EXTERNAL
+                : stage->opcode);
+        request->args = expandCommand(shell, stage);
+        request->argCount = stage->argCount;
+        request->fileIn = (stage->fileIn == NULL ? NULL
+                : expandWord(shell, stage->fileIn));
+        request->fileOut = (stage->fileOut == NULL ? NULL
+                : expandWord(shell, stage->fileOut));
+        request->inFd = -1;
+        request->outFd = -1;
+        request->background = pipeline->background;
+        request->pgid = 0;
+        request->env = shell->env.entries;
+        request->cwd = shell->cwd;
+        ++numStages;
+    }
+
+    traceSpan("expand", "expand", start, 0, -1);
+
+    // Connect each stage to the next
+    for(i = 0; i + 1 < numStages; ++i) {
+        if(pipe2(pipes[i], O_CLOEXEC) == -1) {
+            printf("Error: %s\n", strerror(errno));
+            while(--i >= 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            *status = SPAWN_FAILED_STATUS;
+            return NULL;
+        }
+
+        stages[i].outFd = pipes[i][1];
+        stages[i + 1].inFd = pipes[i][0];
+    }
+
+    // A $(...) reads what the last program writes
+    if(shell->capture != NULL && opcodes[numStages - 1] == OP_EXTERNAL) {
+        openCapture(shell->capture);
+        if(shell->capture->writeFd != -1) {
+            stages[numStages - 1].outFd = fcntl(shell->capture->writeFd,
+                    F_DUPFD_CLOEXEC, 0);
+        }
+    }
+
+    job = newJob();
+    job->numStages = numStages;
+    job->background = pipeline->background;
+
+    // Start all external stages, the first one leads the process group
+    for(i = 0; i < numStages; ++i) {
+        if(opcodes[i] != OP_EXTERNAL) {
+            continue;
+        }
+
+        stages[i].pgid = pgid;
+
+        if(stages[i].fileIn != NULL) {
+            countInput(shellPath(shell, stages[i].fileIn, path));
+        }
+        if(stages[i].fileOut != NULL) {
+            job->procs[i].fileOut = strdup(shellPath(shell,
+                    stages[i].fileOut, path));
+            job->procs[i].outStart = fileSize(job->procs[i].fileOut);
+        }
+
+        job->procs[i].pid = spawnProcess(shell, &stages[i]);
+
+        if(job->procs[i].pid == -1) {
+            // Spawn failed, error was already printed
+            job->procs[i].pid = 0;
+        } else {
+            if(pgid == 0) {
+                pgid = job->procs[i].pid;
+            }
+            job->lastPid = job->procs[i].pid;
+            ++job->running;
+        }
+
+        // Done with the stage's ends, except for the ones a builtin
+        // stage still has to write to
+        if(stages[i].inFd != -1) {
+            close(stages[i].inFd);
+            stages[i].inFd = -1;
+        }
+        if(stages[i].outFd != -1) {
+            close(stages[i].outFd);
+            stages[i].outFd = -1;
+        }
+    }
+
+    if(job->running > 0) {
+        job->pgid = (pipeline->background ? pgid : 0);
+        job->command = jobText(stages, numStages, pipeline->background);
+        addJob(&shell->jobs, job);
+    }
+
+    // Builtin stages don't read stdin, only their output matters
+    for(i = 0; i < numStages; ++i) {
+        if(opcodes[i] == OP_EXTERNAL) {
+            continue;
+        }
+
+        if(stages[i].inFd != -1) {
+            close(stages[i].inFd);
+        }
+
+        // Nobody will ever read a pipe into another builtin
+        if(i + 1 < numStages && opcodes[i + 1] != OP_EXTERNAL) {
+            close(stages[i].outFd);
+            stages[i].outFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        }
+
+        failed = runBuiltinStage(shell, opcodes[i], stages[i].args,
+                stages[i].argCount, stages[i].outFd);
+    }
+
+    if(opcodes[numStages - 1] != OP_EXTERNAL) {
+        if(failed) {
+            setStatusVar(shell, 1 << 8);
+        } else if(numStages > 1) {
+            // Last stage was a builtin
+            setLocalVar(shell, "?", "0");
+        }
+    } else if(job->procs[numStages - 1].pid == 0) {
+        *status = SPAWN_FAILED_STATUS;
+        job->status = SPAWN_FAILED_STATUS;
+    }
+
+    if(job->running == 0) {
+        removeJob(&shell->jobs, job);
+        return NULL;
+    }
+
+    return job;
+}
+
+
+
+/*
+ * Waits on a job in the foreground. When it finishes, $? gets the
+ * status of its last stage and the job is dropped. When it gets
+ * stopped (Ctrl-Z) it stays in the job table for fg and bg.
+ */
+static void waitForeground(struct interpreter *shell, struct job *job) {
+    double start = (tracing ? traceNow() : 0);
+
+    job->background = 0;
+    waitForJob(&shell->jobs, job);
+    traceSpan("wait", "wait", start, 0, job->running > 0 ? -1 : job->status);
+
+    if(job->stopped) {
+        job->background = 1;
+        printJob(stdout, job);
+        return;
+    }
+
+    // Only stages that were started point back at their job
+    if(job->procs[job->numStages - 1].job == job) {
+        setStatusVar(shell, job->status);
+    }
+
+    addUsage(&shell->childUsage, &job->usage);
+    removeJob(&shell->jobs, job);
+}
+
+
+
+/*
+ * Calls external commands through spawnProcess.
+ * Handles pipelines (|), background processes (&)
+ * and I/O redirection (< and >).
+ *
+ * Every stage of a pipeline is started before the shell waits on any of
+ * them. $? comes from the last stage and & puts the whole pipeline into
+ * one background process group, which stays in the job table.
+ */
+int forkCommand(struct interpreter *shell, struct command *pipeline) {
+    int status;
+    struct job *job = startPipeline(shell, pipeline, &status);
+
+    if(job == NULL) {
+        // Didn't start, an if or while needs to see that in $?
+        if(status != 0) {
+            setStatusVar(shell, status);
+        }
+        return (status != 0);
+    }
+
+    // The output of a $(...) is read while it runs, a full pipe would
+    // stop it before it's done
+    if(shell->capture != NULL && !pipeline->background) {
+        readCapture(shell->capture);
+    }
+
+    // parent process
+    if(!pipeline->background) {
+        waitForeground(shell, job);
+
+    } else {
+        // Getting the pid as a string
+        int lengthOfPID = lengthOfInt(job->lastPid);
+        char pidBuffer[lengthOfPID + 1];
+        sprintf(pidBuffer, "%d", job->lastPid);
+        setLocalVar(shell, "!", pidBuffer);
+
+        if(interactive) {
+            printf("[%d] %d\n", job->id, (int) job->lastPid);
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Notes a finished parallel job and keeps track of the first failure
+ */
+static void finishParallelJob(struct parallelRun *run, int order,
+        int status) {
+    LOG(LOG_INFO, "Parallel job %d is done. Status: %d\n", order, status);
+
+    if(status != 0 && (run->failedOrder == -1 || order < run->failedOrder)) {
+        run->failedOrder = order;
+        run->failedStatus = status;
+    }
+}
+
+
+
+/*
+ * Waits for at least one job of a parallel block to finish, and
+ * frees up the slots of every job that has.
+ */
+static void reapParallelJob(struct parallelRun *run) {
+    int freed = 0;
+    int i;
+
+    while(!freed) {
+        handleEvents(&run->shell->jobs, 1);
+
+        for(i = 0; i < run->maxJobs; ++i) {
+            struct job *job = run->slots[i].job;
+
+            if(job == NULL || job->running > 0) {
+                continue;
+            }
+
+            finishParallelJob(run, run->slots[i].order, job->status);
+            addUsage(&run->shell->childUsage, &job->usage);
+            removeJob(&run->shell->jobs, job);
+            run->slots[i].job = NULL;
+            --run->running;
+            freed = 1;
+        }
+    }
+}
+
+
+
+/*
+ * Starts a pipeline in a free slot of a parallel block
+ */
+static void startParallelJob(struct parallelRun *run,
+        struct command *pipeline) {
+    struct parallelSlot *slot = run->slots;
+    struct job *job;
+    int order = run->started++;
+    int status;
+
+    job = startPipeline(run->shell, pipeline, &status);
+    if(job == NULL) {
+        // Only builtins, or nothing could be started
+        finishParallelJob(run, order, status);
+        return;
+    }
+
+    while(slot->job != NULL) {
+        ++slot;
+    }
+
+    slot->job = job;
+    slot->order = order;
+    ++run->running;
+}
+
+
+
+/*
+ * Seconds in a timeval
+ */
+static double seconds(struct timeval *time) {
+    return time->tv_sec + time->tv_usec / 1e6;
+}
+
+
+
+/*
+ * Starts measuring what a command costs
+ */
+static void startCost(struct interpreter *shell, struct costTimer *timer) {
+    timer->children = shell->childUsage;
+    memset(&shell->childUsage, 0, sizeof(shell->childUsage));
+
+    getrusage(RUSAGE_THREAD, &timer->self);
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+
+
+/*
+ * Works out what the command since startCost cost: the shell's own
+ * CPU time (builtins, spawning) plus whatever the jobs it waited on
+ * used, as reported by wait4.
+ */
+static void stopCost(struct interpreter *shell, struct costTimer *timer,
+        struct commandCost *cost) {
+    struct rusage *childUsage = &shell->childUsage;
+    struct timespec end;
+    struct rusage self;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_THREAD, &self);
+
+    cost->wall = (end.tv_sec - timer->start.tv_sec)
+            + (end.tv_nsec - timer->start.tv_nsec) / 1e9;
+    cost->user = seconds(&self.ru_utime) - seconds(&timer->self.ru_utime)
+            + seconds(&childUsage->ru_utime);
+    cost->sys = seconds(&self.ru_stime) - seconds(&timer->self.ru_stime)
+            + seconds(&childUsage->ru_stime);
+    cost->maxRss = (childUsage->ru_maxrss > 0 ? childUsage->ru_maxrss
+            : self.ru_maxrss);
+    cost->voluntary = self.ru_nvcsw - timer->self.ru_nvcsw
+            + childUsage->ru_nvcsw;
+    cost->involuntary = self.ru_nivcsw - timer->self.ru_nivcsw
+            + childUsage->ru_nivcsw;
+
+    // A measurement around this one counts these jobs too
+    addUsage(&timer->children, childUsage);
+    *childUsage = timer->children;
+}
+
+
+
+/*
+ * The time command: runs the command in its body and prints what it
+ * cost to stderr, $? is left to the command.
+ */
+void runTimed(struct interpreter *shell, struct command *command) {
+    struct costTimer timer;
+    struct commandCost cost;
+
+    if(command->body == NULL) {
+        printf("Usage: time command\n");
+        return;
+    }
+
+    startCost(shell, &timer);
+    runCommand(shell, command->body);
+    stopCost(shell, &timer, &cost);
+
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n"
+            "maxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+            cost.wall, cost.user, cost.sys, cost.maxRss, cost.voluntary,
+            cost.involuntary);
+}
+
+
+
+/*
+ * Runs the commands in a block's body one after the other, like the
+ * lines of a script
+ */
+static void runBody(struct interpreter *shell, struct command *command) {
+    for(; command != NULL; command = command->next) {
+        runCommand(shell, command);
+        freeArgBuffer(shell);
+    }
+}
+
+
+
+/*
+ * Runs the condition of an if or while. It holds when $? is left at 0.
+ */
+static int conditionHolds(struct interpreter *shell,
+        struct command *condition) {
+    struct variableHashStruct *status;
+
+    runCommand(shell, condition);
+    freeArgBuffer(shell);
+
+    status = findLocalVar(shell, "?");
+    return status != NULL && atoi(status->value) == 0;
+}
+
+
+
+/*
+ * Whether Ctrl-C was pressed since the top-level command started, so
+ * it stops the loops around this one too. Builtins don't wait on
+ * anything, so the signal is looked for here too.
+ */
+static int loopInterrupted(struct interpreter *shell) {
+    handleEvents(&shell->jobs, 0);
+    return shell->jobs.interrupted > 0;
+}
+
+
+
+/*
+ * if condition; then ... else ... fi
+ */
+static void runIf(struct interpreter *shell, struct command *command) {
+    if(conditionHolds(shell, command->condition)) {
+        runBody(shell, command->body);
+    } else {
+        runBody(shell, command->elseBody);
+    }
+}
+
+
+
+/*
+ * while condition; do ... done
+ * The condition and body are run from the parsed block every time
+ * around, nothing is parsed again. Ctrl-C stops the loop.
+ */
+static void runWhile(struct interpreter *shell, struct command *command) {
+    while(!loopInterrupted(shell)
+            && conditionHolds(shell, command->condition)) {
+        runBody(shell, command->body);
+    }
+}
+
+
+
+/*
+ * for name in words; do ... done
+ * The words are expanded once, then split at spaces, so a $var with
+ * several words in it gives one run each. Ctrl-C stops the loop.
+ */
+static void runFor(struct interpreter *shell, struct command *command) {
+    char **args = expandCommand(shell, command);
+    char *name = strdup(args[1]);
+    char *words, *end, *word, *rest;
+    size_t length = 1;
+    int i;
+
+    // The body frees the expanded args, the words need a copy
+    for(i = 3; i < command->argCount; ++i) {
+        length += strlen(args[i]) + 1;
+    }
+    words = end = (char *) malloc(length);
+    for(i = 3; i < command->argCount; ++i) {
+        end = stpcpy(end, args[i]);
+        *end++ = ' ';
+    }
+    *end = 0;
+
+    for(word = strtok_r(words, " \t\n", &rest); word != NULL;
+            word = strtok_r(NULL, " \t\n", &rest)) {
+        if(loopInterrupted(shell)) {
+            break;
+        }
+        setLocalVar(shell, name, word);
+        runBody(shell, command->body);
+    }
+
+    free(words);
+    free(name);
+}
+
+
+
+/*
+ * function name { ... }
+ * A body in a script stays where it is, the script is kept for it.
+ * One typed at the prompt or in a $(...) is copied, those lines go.
+ */
+static void runFunctionDefinition(struct interpreter *shell,
+        struct command *command) {
+    struct program *copy;
+
+    if(shell->program != NULL) {
+        defineFunction(shell, command->args[1].text, command->body,
+                shell->program);
+        return;
+    }
+
+    copy = copyBlock(command->body);
+    defineFunction(shell, command->args[1].text, copy->first, copy);
+    freeProgram(copy);
+}
+
+
+
+/*
+ * The function a command calls, NULL if it isn't a call. Functions run
+ * in the shell, so not as part of a pipeline or in the background.
+ */
+static struct function *calledFunction(struct interpreter *shell,
+        struct command *command) {
+    if(command->opcode != OP_EXTERNAL || command->pipeNext != NULL
+            || command->background) {
+        return NULL;
+    }
+
+    return findFunction(shell, command->args[0].text);
+}
+
+
+
+/*
+ * Makes args $1, $2... and unsets the ones after them that were set.
+ * A NULL arg is left unset.
+ */
+static void setArgs(struct interpreter *shell, char **args, int count) {
+    char id[16];
+    int i;
+
+    for(i = 0; i < count || i < shell->numArgs; ++i) {
+        sprintf(id, "%d", i + 1);
+        if(i < count && args[i] != NULL) {
+            setLocalVar(shell, id, args[i]);
+        } else {
+            removeVar(&shell->localVars, id);
+        }
+    }
+
+    shell->numArgs = count;
+}
+
+
+
+/*
+ * Copies $1, $2... out, for restoreArgs to put back
+ */
+static int saveArgs(struct interpreter *shell, char **saved) {
+    char id[16];
+    int i;
+
+    for(i = 0; i < shell->numArgs; ++i) {
+        struct variableHashStruct *var;
+
+        sprintf(id, "%d", i + 1);
+        var = findVar(&shell->localVars, id);
+        saved[i] = (var != NULL ? strdup(var->value) : NULL);
+    }
+
+    return shell->numArgs;
+}
+
+
+
+/*
+ * Puts back the $1, $2... saveArgs copied out
+ */
+static void restoreArgs(struct interpreter *shell, char **saved, int count) {
+    int i;
+
+    setArgs(shell, saved, count);
+    for(i = 0; i < count; ++i) {
+        free(saved[i]);
+    }
+}
+
+
+
+/*
+ * Runs body, a function's or a whole program's, with args as $1, $2...
+ * for as long as it runs, so each call has its own. NULL args leaves
+ * them alone. The program is held on to meanwhile, the function could
+ * be redefined in there.
+ */
+static void runWithArgs(struct interpreter *shell, struct program *program,
+        struct command *body, char **args, int count) {
+    struct program *savedProgram = shell->program;
+    char *saved[MAX_ARGS];
+    int savedCount = 0;
+
+    if(args != NULL) {
+        savedCount = saveArgs(shell, saved);
+        setArgs(shell, args, count);
+    }
+    retainProgram(program);
+    shell->program = program;
+
+    runBody(shell, body);
+
+    shell->program = savedProgram;
+    freeProgram(program);
+    if(args != NULL) {
+        restoreArgs(shell, saved, savedCount);
+    }
+}
+
+
+
+/*
+ * Calls a function, its args are $1, $2... inside it
+ */
+static void callFunction(struct interpreter *shell, struct function *function,
+        struct command *command) {
+    char **args = expandCommand(shell, command);
+
+    if(displayCommand) {
+        printf("%s\n", args[0]);
+    }
+
+    runWithArgs(shell, function->program, function->body, args + 1,
+            command->argCount - 1);
+}
+
+
+
+/*
+ * source file [args]
+ * Runs the file's commands in this shell, so its variables and
+ * functions stay. The parse is cached, see sourceScript. With args,
+ * they are $1, $2... while it runs, otherwise it sees the caller's.
+ */
+static int sourceFile(struct interpreter *shell, char **args, int argCount) {
+    char path[PATH_MAX];
+    struct program *program = sourceScript(shellPath(shell, args[1], path));
+
+    if(program == NULL) {
+        fprintf(stderr, "source: %s: %s\n", args[1], strerror(errno));
+        return 1;
+    }
+
+    runWithArgs(shell, program, program->first,
+            argCount > 2 ? args + 2 : NULL, argCount - 2);
+    freeProgram(program);
+    return 0;
+}
+
+
+
+/*
+ * Works out how many jobs a parallel block may run at once:
+ *   parallel           one per online CPU
+ *   parallel -j N      N
+ * Returns -1 if the args don't make sense.
+ */
+static int parallelJobs(char **args, int argCount) {
+    char *jobs;
+    char *end;
+    long count;
+
+    if(argCount == 1) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+        return (count < 1 ? 1 : (int) count);
+    }
+
+    if(argCount == 3 && strcmp(args[1], "-j") == 0) {
+        jobs = args[2];
+    } else if(argCount == 2 && strncmp(args[1], "-j", 2) == 0) {
+        jobs = args[1] + 2;
+    } else {
+        return -1;
+    }
+
+    count = strtol(jobs, &end, 10);
+    if(end == jobs || *end != 0 || count < 1 || count > INT_MAX) {
+        return -1;
+    }
+
+    return (int) count;
+}
+
+
+
+/*
+ * Runs the body of a parallel block with at most N jobs in flight.
+ * Pipelines are queued in order and the next one starts as soon as
+ * any slot frees up. Builtins and nested blocks wait for everything
+ * before them, so "set" or "chdir" in the middle affects the jobs
+ * after it. $? ends up 0 when every job succeeded, otherwise the
+ * status of the first job (in block order) that failed.
+ */
+void runParallel(struct interpreter *shell, struct command *block) {
+    struct parallelRun run;
+    struct command *command;
+
+    run.shell = shell;
+    run.maxJobs = parallelJobs(expandCommand(shell, block), block->argCount);
+    if(run.maxJobs == -1) {
+        printf("Usage: parallel [-j jobs]\n");
+        return;
+    }
+
+    if(displayCommand) {
+        printf("parallel -j %d\n", run.maxJobs);
+    }
+
+    run.slots = (struct parallelSlot *) calloc(run.maxJobs,
+            sizeof(struct parallelSlot));
+    run.running = 0;
+    run.started = 0;
+    run.failedOrder = -1;
+    run.failedStatus = 0;
+
+    for(command = block->body; command != NULL; command = command->next) {
+        if(isProgram(command, 1) && calledFunction(shell, command) == NULL) {
+            if(command->background) {
+                // & jobs aren't waited on, there or here
+                forkCommand(shell, command);
+            } else {
+                while(run.running == run.maxJobs) {
+                    reapParallelJob(&run);
+                }
+                startParallelJob(&run, command);
+            }
+        } else {
+            while(run.running > 0) {
+                reapParallelJob(&run);
+            }
+            runCommand(shell, command);
+
+            // A nested block counts as one job
+            if(command->opcode == OP_PARALLEL) {
+                struct variableHashStruct *status = findLocalVar(shell, "?");
+
+                finishParallelJob(&run, run.started++,
+                        status == NULL ? 0 : atoi(status->value));
+            }
+        }
+
+        // Started jobs don't need their expanded args any more
+        freeArgBuffer(shell);
+    }
+
+    while(run.running > 0) {
+        reapParallelJob(&run);
+    }
+
+    free(run.slots);
+    setStatusVar(shell, run.failedOrder == -1 ? 0 : run.failedStatus);
+}
+
+
+
+/*
+ * Processes the string read in from the command line.
+ * Splits the string into an array of pointers to strings.
+ * Each word in the command becomes an individual element.
+ * The words are cut out of line in place, so they live
+ * exactly as long as the line does. The words are found in one pass,
+ * see tokenizeLine.
+ *
+ * Comments (#) are ignored.
+ */
+void splitCommand(char* line, char **argBuffer, int *argCount) {
+    struct token tokens[MAX_LINE_WORDS];
+    int count = tokenizeLine(line, strlen(line), tokens, MAX_LINE_WORDS);
+    int j;
+
+    for(j = 0; j < count; ++j) {
+        argBuffer[j] = line + tokens[j].start;
+        argBuffer[j][tokens[j].length] = 0;
+    }
+
+    // terminates args with null char
+    argBuffer[count] = 0;
+    *argCount = count;
+
+    if(LOG_ENABLED(LOG_TRACE)) {
+        for(j = 0; j < count; ++j) {
+            logMessage("args: %s\n", argBuffer[j]);
+        }
+    }
+}
+
+
+
+
+/*
+ * Finds and displayed the command.
+ * Words with variables ($x, ${x}, foo$x) are expanded first, a word
+ * with a variable that isn't set is reported instead.
+ */
+void showVar(struct interpreter *shell, char ** argBuffer, int argCount) {
+    int missing;
+    char *value;
+    int i;
+
+    for(i = 1; i < argCount; ++i) {
+        if(strchr(argBuffer[i], '$') == NULL) {
+            // Just print out the word
+            fprintf(shell->out, "%s ", argBuffer[i]);
+            continue;
+        }
+
+        value = expandText(shell, argBuffer[i], &missing);
+
+        if(missing > 0) {
+            // Variable not found
+            fprintf(shell->out, "%s not found\n", argBuffer[i]);
+        } else {
+            if(displayCommand) {
+                printf("show %s\n", argBuffer[i]);
+            }
+
+            fprintf(shell->out, "%s ", value);
+        }
+    }
+
+    fprintf(shell->out, "\n");
+}
+
+
+
+
+/*
+ * Removes the variable from the local variable table.
+ * Its slot gets reused by later variables.
+ */
+void unsetVar(struct interpreter *shell, char ** argBuffer) {
+    // Find the struct
+    struct variableHashStruct *var;
+    var = findLocalVar(shell, argBuffer[1]);
+
+    if(var == NULL) {
+        printf("%s not found\n", argBuffer[1]);
+    } else {
+        if(displayCommand) {
+            printf("unset %s\n", argBuffer[1]);
+        }
+
+        LOG(LOG_DEBUG, "var val: %s\n", var->value);
+
+        // Delete the struct
+        removeVar(&shell->localVars, argBuffer[1]);
+    }
+}
+
+
+
+/*
+ * The hash command manages the command path cache.
+ *   hash             lists the cached paths
+ *   hash -r          forgets all of them
+ *   hash name ...    looks each name up in $PATH and caches it
+ */
+void hashCommand(struct interpreter *shell, char ** argBuffer,
+        int argCount) {
+    struct variableHashStruct *var;
+    char pathBuffer[PATH_MAX];
+    unsigned int index = 0;
+    int i;
+
+    if(displayCommand) {
+        printf("hash");
+        for(i = 1; i < argCount; ++i) {
+            printf(" %s", argBuffer[i]);
+        }
+        printf("\n");
+    }
+
+    if(argCount == 1) {
+        while((var = nextVar(&shell->commandPaths, &index)) != NULL) {
+            fprintf(shell->out, "%s\t%s\n", var->id, var->value);
+        }
+        return;
+    }
+
+    if(argCount == 2 && strcmp(argBuffer[1], "-r") == 0) {
+        clearCommandPaths(shell);
+        return;
+    }
+
+    for(i = 1; i < argCount; ++i) {
+        if(strchr(argBuffer[i], '/') != NULL) {
+            printf("%s: not a command name\n", argBuffer[i]);
+            continue;
+        }
+
+        // Forget any old entry so this really searches $PATH again
+        removeVar(&shell->commandPaths, argBuffer[i]);
+
+        if(resolveCommand(shell, argBuffer[i], pathBuffer) == NULL) {
+            printf("%s not found\n", argBuffer[i]);
+        }
+    }
+}
+
+
+
+/*
+ * Called once at the start of the program. This
+ * sets the default values for $$, $!, and $?.
+ */
+void setBasicEnvVar(struct interpreter *shell) {
+    // $ - PID of shell
+    // Getting the pid as a string
+    int mainPID = getpid();
+    int lengthOfPID = lengthOfInt(mainPID);
+    char pidBuffer[lengthOfPID + 1];
+    sprintf(pidBuffer, "%d", mainPID);
+    setLocalVar(shell, "$", pidBuffer);
+
+    // ? - Decimal value returned by last foreground process
+    setLocalVar(shell, "?", "-1");
+
+    // ! - PID of last background process
+    setLocalVar(shell, "!", "-1");
+}
+
+
+
+/*
+ * Looks up a variable for the expander, the shell's own first, then
+ * the environment. name is length bytes, not NUL terminated.
+ */
+static char *lookupVar(struct interpreter *shell, const char *name,
+        size_t length) {
+    char buffer[MAX_VAR_SIZE];
+    char *id = buffer;
+    struct variableHashStruct *var;
+
+    if(length == 0) {
+        return NULL;
+    }
+
+    // Names have no length limit, a long one goes into the arena
+    if(length >= sizeof(buffer)) {
+        id = (char *) arenaAlloc(&shell->commandArena, length + 1);
+    }
+
+    memcpy(id, name, length);
+    id[length] = 0;
+
+    var = findLocalVar(shell, id);
+    if(var != NULL) {
+        return var->value;
+    }
+
+    return findEnvVar(&shell->env, id);
+}
+
+
+
+/*
+ * Adds length bytes of text to the end of an expansion, growing it
+ * in the command arena. Stays NUL terminated.
+ */
+static void appendText(struct arena *arena, struct expansion *out,
+        const char *text, size_t length) {
+    if(out->length + length + 1 > out->capacity) {
+        size_t capacity = out->capacity * 2;
+
+        if(capacity < out->length + length + 1) {
+            capacity = out->length + length + 1 + EXPANSION_SLACK;
+        }
+
+        out->text = (char *) arenaGrow(arena, out->text,
+                out->capacity, capacity);
+        out->capacity = capacity;
+    }
+
+    memcpy(out->text + out->length, text, length);
+    out->length += length;
+    out->text[out->length] = 0;
+}
+
+
+
+/*
+ * Where the $( starting at text ends: its matching ), or NULL if it's
+ * never closed. text points past the $(.
+ */
+static const char *substitutionEnd(const char *text) {
+    int depth = 1;
+
+    for(; *text != 0; ++text) {
+        if(text[0] == '$' && text[1] == '(') {
+            ++depth;
+            ++text;
+        } else if(*text == ')' && --depth == 0) {
+            return text;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Runs the command in text (length bytes) for $(...), and adds what it
+ * wrote to out without the newlines at the end. Builtins and utilities
+ * run in the shell and write straight into the capture, programs into
+ * a pipe that forkCommand reads. It gets an arena of its own, the one
+ * out is in stays as it is.
+ */
+static void substituteCommand(struct interpreter *shell, const char *text,
+        size_t length, struct arena *arena, struct expansion *out) {
+    static cookie_io_functions_t captureIo = {NULL, writeCapture, NULL,
+            NULL};
+    struct capture capture = {NULL, 0, 0, 0, -1, -1};
+    struct capture *savedCapture = shell->capture;
+    struct program *savedProgram = shell->program;
+    struct arena savedArena = shell->commandArena;
+    FILE *savedOut = shell->out;
+    jmp_buf *savedExit = shell->exitJump;
+    jmp_buf exitJump;
+    int savedDepth = shell->commandDepth;
+    struct blockParser blocks;
+    struct arena parsed;
+    struct command *command;
+    double start = (tracing ? traceNow() : 0);
+    char *line;
+
+    // Blocks run their commands one at a time, resetting commandArena
+    // in between, so the parsed line goes somewhere else
+    initArena(&parsed, ARENA_SIZE);
+    line = (char *) arenaAlloc(&parsed, length + 1);
+    memcpy(line, text, length);
+    line[length] = 0;
+
+    initBlockParser(&blocks);
+    command = parseLine(&parsed, line, 0);
+    if(command != NULL) {
+        addCommand(&blocks, &parsed, command);
+        closeBlocks(&blocks, &parsed);
+    }
+
+    initArena(&shell->commandArena, ARENA_SIZE);
+
+    if(blocks.first != NULL) {
+        shell->capture = &capture;
+        shell->out = fopencookie(&capture, "w", captureIo);
+        shell->program = NULL;
+
+        // exit in here only ends the $(...)
+        shell->exitJump = &exitJump;
+        if(setjmp(exitJump) == 0) {
+            for(command = blocks.first; command != NULL;
+                    command = command->next) {
+                runCommand(shell, command);
+                freeArgBuffer(shell);
+            }
+        } else {
+            // Out of the middle of its runCommand calls
+            shell->commandDepth = savedDepth;
+            setStatusVar(shell, shell->exitCode << 8);
+        }
+
+        fclose(shell->out);
+        shell->out = savedOut;
+        shell->capture = savedCapture;
+        shell->exitJump = savedExit;
+        shell->program = savedProgram;
+
+        // Whatever & jobs wrote, like sh it waits for them to finish
+        readCapture(&capture);
+    }
+
+    if(tracing) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "$(%.*s)", (int) length, text);
+        traceSpan("subst", name, start, 0, -1);
+    }
+
+    freeArena(&shell->commandArena);
+    freeArena(&parsed);
+    shell->commandArena = savedArena;
+
+    if(capture.overflow) {
+        fprintf(stderr, "Error: $(%.*s) wrote more than %zu bytes, the "
+                "rest was cut off\n", (int) length, text, substLimit);
+    }
+
+    while(capture.length > 0 && capture.text[capture.length - 1] == '\n') {
+        --capture.length;
+    }
+
+    appendText(arena, out, capture.text != NULL ? capture.text : "",
+            capture.length);
+    free(capture.text);
+}
+
+
+
+/*
+ * Expands every $name, ${name}, $$, $?, $! and $N in text, in one
+ * pass over it, into the command arena. Values are copied, set may
+ * overwrite a variable while the old value is still in use.
+ * A variable that isn't set is left as written and counted in
+ * *missing, a $ that doesn't start a variable is just a $.
+ * $(command) is replaced by what the command wrote.
+ */
+char *expandText(struct interpreter *shell, const char *text,
+        int *missing) {
+    struct arena *arena = &shell->commandArena;
+    struct expansion out = {NULL, 0, 0};
+    const char *copied = text;      // text up to here is in out
+    const char *dollar = text;
+    const char *name, *end;
+    char *value;
+
+    *missing = 0;
+
+    while((dollar = strchr(dollar, '$')) != NULL) {
+        name = dollar + 1;
+
+        if(*name == '(') {
+            end = substitutionEnd(name + 1);
+            if(end == NULL) {
+                // Never closed, the rest is just text
+                break;
+            }
+            appendText(arena, &out, copied, dollar - copied);
+            substituteCommand(shell, name + 1, end - name - 1, arena, &out);
+            copied = dollar = end + 1;
+            continue;
+        } else if(*name == '{') {
+            end = strchr(++name, '}');
+            if(end == NULL) {
+                // Never closed, the rest is just text
+                break;
+            }
+            value = lookupVar(shell, name, end - name);
+            ++end;
+        } else if(*name == '$' || *name == '?' || *name == '!') {
+            end = name + 1;
+            value = lookupVar(shell, name, 1);
+        } else if(isdigit((unsigned char) *name)) {
+            for(end = name; isdigit((unsigned char) *end); ++end) {
+            }
+            value = lookupVar(shell, name, end - name);
+        } else if(isalpha((unsigned char) *name) || *name == '_') {
+            for(end = name; isalnum((unsigned char) *end) || *end == '_';
+                    ++end) {
+            }
+            value = lookupVar(shell, name, end - name);
+        } else {
+            ++dollar;
+            continue;
+        }
+
+        if(value == NULL) {
+            ++*missing;
+        } else {
+            appendText(arena, &out, copied, dollar - copied);
+            appendText(arena, &out, value, strlen(value));
+            copied = end;
+        }
+
+        dollar = end;
+    }
+
+    appendText(arena, &out, copied, strlen(copied));
+    return out.text;
+}
+
+
+
+/*
+ * Expands the variables in a word. Words without any come back as is,
+ * so do words whose variables aren't set.
+ */
+char *expandWord(struct interpreter *shell, struct word *word) {
+    int missing;
+    char *text;
+
+    if(!word->isVar) {
+        return word->text;
+    }
+
+    text = expandText(shell, word->text, &missing);
+
+    if(missing > 0) {
+        // Variable not found
+        LOG(LOG_INFO, "%s not found\n", word->text);
+    }
+
+    return text;
+}
+
+
+
+/*
+ * Replaces any variables in a command with its value.
+ * Fills argBuffer with the text of each of the count words.
+ */
+void subVar(struct interpreter *shell, struct word *words, int count,
+        char **argBuffer) {
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        argBuffer[i] = expandWord(shell, &words[i]);
+    }
+}
+
+
+
+/*
+ * Builds the NULL terminated arg list to run command with, in the
+ * command arena. show looks its variables up itself, so its words
+ * are left alone.
+ */
+char **expandCommand(struct interpreter *shell, struct command *command) {
+    char **args = (char **) arenaAlloc(&shell->commandArena,
+            sizeof(char *) * (command->argCount + 1));
+    int i;
+
+    if(command->opcode == OP_SHOW) {
+        for(i = 0; i < command->argCount; ++i) {
+            args[i] = command->args[i].text;
+        }
+    } else {
+        subVar(shell, command->args, command->argCount, args);
+    }
+
+    args[command->argCount] = NULL;
+    return args;
+}
+
+
+
+/*
+ * Reads one whole line from input into the command arena.
+ * The buffer starts at MAX_LINE_SIZE and grows in place as needed.
+ * Returns NULL at end of input.
+ */
+char *readLine(struct interpreter *shell, FILE *input) {
+    size_t size = MAX_LINE_SIZE;
+    size_t length = 0;
+    char *buffer = (char *) arenaAlloc(&shell->commandArena, size);
+
+    while(fgets(buffer + length, size - length, input) != NULL) {
+        length += strlen(buffer + length);
+
+        // Got the whole line, or the last line had no newline
+        if(buffer[length - 1] == '\n' || length + 1 < size) {
+            return buffer;
+        }
+
+        buffer = (char *) arenaGrow(&shell->commandArena, buffer, size,
+                size * 2);
+        size *= 2;
+    }
+
+    return (length > 0 ? buffer : NULL);
+}
+
+
+
+/*
+ * Gets the next line from stdinReader. When stdin is a mapped file its
+ * offset is kept in step with the lines, so a program that reads stdin
+ * gets the rest of the input (and the shell carries on after whatever
+ * it read), like with a line-at-a-time read.
+ * Returns NULL at end of input.
+ */
+char *readStdinLine() {
+    size_t length;
+    char *next;
+
+    if(stdinReader.mapped) {
+        off_t offset = lseek(0, 0, SEEK_CUR);
+
+        if(offset >= stdinReader.start
+                && offset <= (off_t) stdinReader.length) {
+            stdinReader.pos = offset;
+        }
+    }
+
+    next = nextLine(&stdinReader, &length);
+
+    if(next != NULL && stdinReader.mapped) {
+        lseek(0, stdinReader.pos, SEEK_SET);
+    }
+
+    return next;
+}
+
+
+
+/*
+ * Prints how much of the command arena commands have been using,
+ * to help pick ARENA_SIZE.
+ */
+void showMemStats(struct interpreter *shell) {
+    struct arena *arena = &shell->commandArena;
+    size_t used = arena->used + arena->extraUsed;
+    size_t highWater = arena->highWater;
+
+    if(used > highWater) {
+        highWater = used;
+    }
+
+    fprintf(shell->out, "arena size: %lu bytes\n", (unsigned long) arena->size);
+    fprintf(shell->out, "arena high water: %lu bytes\n", (unsigned long) highWater);
+    fprintf(shell->out, "arena resets: %lu\n", arena->resets);
+    fprintf(shell->out, "arena overflows: %lu\n", arena->overflows);
+}
+
+
+
+
+/*
+ * Finds the job fg or bg should use: "%N" or "N" is job number N,
+ * no arg is the most recent job.
+ */
+static struct job *jobArg(struct interpreter *shell, char **argBuffer,
+        int argCount) {
+    char *id;
+
+    if(argCount == 1) {
+        return currentJob(&shell->jobs);
+    }
+
+    id = argBuffer[1];
+    if(id[0] == '%') {
+        ++id;
+    }
+
+    return findJob(&shell->jobs, atoi(id));
+}
+
+
+
+/*
+ * The fg command. The job gets the terminal (when it has its own
+ * process group) and is continued if it was stopped, then the shell
+ * waits on it like on any foreground command.
+ */
+static void foregroundJob(struct interpreter *shell, struct job *job) {
+    pid_t pgid = job->pgid;
+
+    fprintf(shell->out, "%s\n", job->command);
+    fflush(shell->out);
+
+    if(interactive && pgid != 0) {
+        tcsetpgrp(0, pgid);
+    }
+
+    if(job->stopped) {
+        signalJob(job, SIGCONT);
+        job->stopped = 0;
+    }
+
+    waitForeground(shell, job);
+
+    if(interactive && pgid != 0) {
+        // SIGTTOU is ignored, so the shell can take the terminal back
+        tcsetpgrp(0, getpgrp());
+    }
+}
+
+
+
+/*
+ * Runs an internal command, its args already have their variables
+ * substituted (except for show, which looks them up itself).
+ * Returns 1 if the command was used wrong, 0 otherwise. Utilities
+ * return their exit status.
+ */
+int runBuiltin(struct interpreter *shell, int opcode, char ** argBuffer,
+        int argCount) {
+    ++metrics.builtins;
+
+    switch(opcode) {
+        case OP_SHOW:
+            LOG(LOG_DEBUG, "got show as input arg\n");
+
+            if(argCount < 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            showVar(shell, argBuffer, argCount);
+            break;
+
+        case OP_SET:
+            LOG(LOG_DEBUG, "got set as input arg\n");
+
+            if(argCount != 3) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("set %s %s\n", argBuffer[1], argBuffer[2]);
+            }
+
+            setLocalVar(shell, argBuffer[1], argBuffer[2]);
+            break;
+
+        case OP_UNSET:
+            LOG(LOG_DEBUG, "got unset as input arg\n");
+
+            if(argCount != 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            unsetVar(shell, argBuffer);
+            break;
+
+        case OP_EXPORT:
+            LOG(LOG_DEBUG, "got export as input arg\n");
+
+            if(argCount != 3) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("export %s %s\n", argBuffer[1], argBuffer[2]);
+            }
+
+            if(exportVar(&shell->env, argBuffer[1], argBuffer[2]) == -1) {
+                printf("Error: %s\n", strerror(EINVAL));
+            }
+
+            if(strcmp(argBuffer[1], "PATH") == 0) {
+                clearCommandPaths(shell);
+            }
+            break;
+
+        case OP_UNEXPORT:
+            LOG(LOG_DEBUG, "got unexport as input arg\n");
+
+            if(argCount != 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("unexport %s\n", argBuffer[1]);
+            }
+
+            unexportVar(&shell->env, argBuffer[1]);
+
+            if(strcmp(argBuffer[1], "PATH") == 0) {
+                clearCommandPaths(shell);
+            }
+            break;
+
+        case OP_HASH:
+            LOG(LOG_DEBUG, "got hash as input arg\n");
+
+            hashCommand(shell, argBuffer, argCount);
+            break;
+
+        case OP_MEMSTAT:
+            LOG(LOG_DEBUG, "got memstat as input arg\n");
+
+            if(displayCommand) {
+                printf("memstat\n");
+            }
+
+            showMemStats(shell);
+            break;
+
+        case OP_CHDIR:
+            LOG(LOG_DEBUG, "got chdir as input arg\n");
+
+            if(argCount != 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("chdir %s\n", argBuffer[1]);
+            }
+
+            // A -P script only moves itself, the process stays put
+            if(shell->cwd != AT_FDCWD) {
+                int cwd = openat(shell->cwd, argBuffer[1],
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+                if(cwd == -1) {
+                    printf("Error: %s\n", strerror(errno));
+                } else {
+                    close(shell->cwd);
+                    shell->cwd = cwd;
+                }
+            } else if(chdir(argBuffer[1]) == -1) {
+                // Error has occurred
+                printf("Error: %s\n", strerror(errno));
+            }
+            break;
+
+        case OP_EXIT: {
+            LOG(LOG_DEBUG, "got exit as input arg\n");
+
+            if(argCount != 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("exit %s\n", argBuffer[1]);
+            }
+
+            int exitCode = atoi(argBuffer[1]);
+
+            // A -P script only ends itself
+            if(shell->exitJump != NULL) {
+                shell->exitCode = exitCode;
+                longjmp(*shell->exitJump, 1);
+            }
+
+            freeArgBuffer(shell);
+            freeLocalVar();
+            exit(exitCode);
+        }
+
+        case OP_WAIT: {
+            LOG(LOG_DEBUG, "got wait as input arg\n");
+
+            if(argCount != 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            if(displayCommand) {
+                printf("wait %s\n", argBuffer[1]);
+            }
+
+            int pid = atoi(argBuffer[1]);
+
+            if(pid == -1) {
+                // Wait for any children
+                waitForAnyJob(&shell->jobs);
+            } else {
+                // Wait for the job pid is part of, if it's still around
+                struct job *job = findJobByPid(&shell->jobs, pid);
+
+                if(job != NULL) {
+                    waitForJob(&shell->jobs, job);
+                    if(job->running == 0) {
+                        addUsage(&shell->childUsage, &job->usage);
+                        removeJob(&shell->jobs, job);
+                    }
+                }
+            }
+
+            break;
+        }
+
+        case OP_JOBS:
+            LOG(LOG_DEBUG, "got jobs as input arg\n");
+
+            if(displayCommand) {
+                printf("jobs\n");
+            }
+
+            listJobs(&shell->jobs, shell->out);
+            break;
+
+        case OP_STATS:
+            LOG(LOG_DEBUG, "got stats as input arg\n");
+
+            if(displayCommand) {
+                printf("stats\n");
+            }
+
+            writeMetrics(shell->out);
+            break;
+
+        case OP_SOURCE:
+            LOG(LOG_DEBUG, "got source as input arg\n");
+
+            if(argCount < 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
+
+            return sourceFile(shell, argBuffer, argCount);
+
+        case OP_ECHO:
+            return echoUtility(shell, argBuffer, argCount);
+
+        case OP_TRUE:
+            return 0;
+
+        case OP_FALSE:
+            return 1;
+
+        case OP_TEST:
+        case OP_BRACKET:
+            return testUtility(shell, argBuffer, argCount);
+
+        case OP_PWD:
+            return pwdUtility(shell, argBuffer, argCount);
+
+        case OP_SLEEP:
+            return sleepUtility(shell, argBuffer, argCount);
+
+        case OP_CAT:
+            return catUtility(shell, argBuffer, argCount);
+
+        case OP_FG:
+        case OP_BG: {
+            LOG(LOG_DEBUG, "got %s as input arg\n", argBuffer[0]);
+
+            if(argCount > 2) {
+                printf("Incorrect number of arguments.\n");
+                return 1;
+            }
 
-    // NOTE max number of 16 args + 1 (null char) + 1 (program name)
-    // char **argBuffer = (char **) malloc(sizeof(char) * MAX_ARGS + 1);
-    arg = (char* ) malloc(sizeof(char) * strlen(program) + 1);
-    strncpy(arg, program, strlen(program) + 1);
-    argBuffer[0] = (char*) arg;
+            if(displayCommand) {
+                printf("%s %s\n", argBuffer[0], argCount == 2 ? argBuffer[1] : "");
+            }
 
+            struct job *job = jobArg(shell, argBuffer, argCount);
 
-    arguments = strtok(NULL, delim);
-    // walk through other tokens
-    while(arguments != NULL && *argCount < MAX_ARGS) {
-        fprintf(stderr, "strtok found an arg: %s\n", arguments);
+            if(job == NULL) {
+                printf("%s: no such job\n", argBuffer[0]);
+            } else if(opcode == OP_FG) {
+                foregroundJob(shell, job);
+            } else {
+                if(job->stopped) {
+                    signalJob(job, SIGCONT);
+                    job->stopped = 0;
+                }
+                job->background = 1;
+                fprintf(shell->out, "[%d] %s\n", job->id, job->command);
+            }
 
-        // Check if rest of line is commented out
-        if(arguments[0] == '#') {
             break;
         }
+    }
 
-        // # in the middle of a word, Cut off line after a "#"
-        char *commented = strchr(arguments, '#');
-        if (commented) {
-            *commented = 0;
-        }
+    return 0;
+}
 
-        // Erasing the new line character
-        char *newline = strchr(arguments, '\n');
-        if (newline) {
-            *newline = 0;
 
-            // if the only character was a new line
-            // Now have an empty string
-            if(arguments[0] == 0) {
-                break;
-            }
+
+/*
+ * The words of a parsed command as one line, for the -T summary and
+ * the trace
+ */
+static char *commandText(struct arena *arena, struct command *command) {
+    struct command *stage;
+    size_t length = 1;
+    char *text;
+    int i;
+
+    for(stage = command; stage != NULL; stage = stage->pipeNext) {
+        for(i = 0; i < stage->argCount; ++i) {
+            length += strlen(stage->args[i].text) + 3;
         }
+    }
 
-        // Save the next argument
-        arg = (char* ) malloc(sizeof(char) * strlen(arguments) + 1);
-        strncpy(arg, arguments, strlen(arguments) + 1);
-        argBuffer[*argCount] = (char*) arg;
+    text = (char *) arenaAlloc(arena, length);
+    text[0] = 0;
 
-        arguments = strtok(NULL, delim);
-        *argCount += 1;
+    for(stage = command; stage != NULL; stage = stage->pipeNext) {
+        if(stage != command) {
+            strcat(text, " |");
+        }
 
-        if (commented) {
-            break;
+        for(i = 0; i < stage->argCount; ++i) {
+            if(text[0] != 0) {
+                strcat(text, " ");
+            }
+            strcat(text, stage->args[i].text);
         }
     }
 
-    // terminates args with null char
-    argBuffer[*argCount] = 0;
+    // time's command, or the condition of an if or while
+    if((command->opcode == OP_TIME && command->body != NULL)
+            || command->condition != NULL) {
+        char *body = commandText(arena, command->opcode == OP_TIME
+                ? command->body : command->condition);
+        char *both = (char *) arenaAlloc(arena, length + strlen(body) + 1);
 
-    for(j = 0; j < *argCount+1; ++j) {
-        fprintf(stderr, "args: %s\n", argBuffer[j]);
+        sprintf(both, "%s %s", text, body);
+        text = both;
     }
 
-    return;
+    return text;
 }
 
 
 
-
 /*
- * Finds and displayed the command.
- * If the user asks for a variable ($) to be displayed,
- * search and then print that variable.
+ * Runs a utility in the shell with its < and > files, and sets $? to
+ * what its wait status would have been as a program
  */
-void showVar(char ** argBuffer, int argCount) {
-    int i;
-
-    for(i = 1; i < argCount; ++i) {
-        if(argBuffer[i][0] == '$') {
-            // Found a var to replace
-            // Removing the $
-            char * searchId = malloc(sizeof(char) * strlen
-                    (argBuffer[i]));
-            strncpy(searchId, argBuffer[i] + 1, strlen(argBuffer[i]));
-
-            // Find the string
-            struct variableHashStruct *localResult = findLocalVar(searchId);
-            if (localResult != NULL) {
-                if (displayCommand) {
-                    printf("show %s\n", argBuffer[i]);
-                }
+static void runUtility(struct interpreter *shell, struct command *command) {
+    char **args = expandCommand(shell, command);
+    FILE *savedOut = shell->out;
+    int status;
 
-                printf("%s ", localResult->value);
-            } else {
-                // Check for global variables
-                char *result = getenv(searchId);
+    if(displayCommand) {
+        printf("%s\n", args[0]);
+    }
 
-                if (result != NULL) {
-                    if (displayCommand) {
-                        printf("show %s\n", argBuffer[i]);
-                    }
+    if(command->fileIn != NULL) {
+        shell->in = openat(shell->cwd, expandWord(shell, command->fileIn),
+                O_RDONLY | O_CLOEXEC);
+        if(shell->in == -1) {
+            printf("Error: %s\n", strerror(errno));
+            shell->in = 0;
+            setStatusVar(shell, 1 << 8);
+            return;
+        }
+    }
 
-                    printf("%s ", result);
+    if(command->fileOut != NULL) {
+        // Opened the same way as for a program, see setupChildFds
+        int fd = openat(shell->cwd, expandWord(shell, command->fileOut),
+                O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
 
-                } else {
-                    // Variable not found
-                    printf("%s not found\n", argBuffer[i]);
-                }
+        if(fd == -1) {
+            printf("Error: %s\n", strerror(errno));
+            if(shell->in != 0) {
+                close(shell->in);
+                shell->in = 0;
             }
+            setStatusVar(shell, 1 << 8);
+            return;
+        }
 
-            free(searchId);
-        } else {
-            // Just print out the word
-            printf("%s ", argBuffer[i]);
+        shell->out = fdopen(fd, "w");
+        if(shell->out == NULL) {
+            printf("Error: %s\n", strerror(errno));
+            close(fd);
+            shell->out = savedOut;
+            if(shell->in != 0) {
+                close(shell->in);
+                shell->in = 0;
+            }
+            setStatusVar(shell, 1 << 8);
+            return;
         }
     }
 
-    printf("\n");
-}
+    status = runBuiltin(shell, command->opcode, args, command->argCount);
+
+    if(shell->out != savedOut) {
+        fclose(shell->out);
+        shell->out = savedOut;
+    }
+    if(shell->in != 0) {
+        close(shell->in);
+        shell->in = 0;
+    }
 
+    setStatusVar(shell, status << 8);
+}
 
 
 
 /*
- * Removed the data of the variable from the
- * local variable array. Doesn't free the space.
- * Freeing happens at the end of the program.
+ * Runs one parsed command: a builtin, a block, or a pipeline of programs.
  */
-void unsetVar(char ** argBuffer) {
-    // Find the struct
-    struct variableHashStruct *var;
-    var = findLocalVar(argBuffer[1]);
+void runCommand(struct interpreter *shell, struct command *command) {
+    double start = (tracing ? traceNow() : 0);
+    struct function *function;
 
-    if(var == NULL) {
-        printf("%s not found\n", argBuffer[1]);
+    ++metrics.commands;
+
+    // Loops stop on a Ctrl-C from anywhere inside the top-level command
+    if(shell->commandDepth++ == 0) {
+        shell->jobs.interrupted = 0;
+    }
+
+    if(command->opcode == OP_ERROR) {
+        printf("%s\n", command->args[0].text);
+    } else if(command->opcode == OP_PARALLEL) {
+        runParallel(shell, command);
+    } else if(command->opcode == OP_TIME) {
+        runTimed(shell, command);
+    } else if(command->opcode == OP_IF) {
+        runIf(shell, command);
+    } else if(command->opcode == OP_WHILE) {
+        runWhile(shell, command);
+    } else if(command->opcode == OP_FOR) {
+        runFor(shell, command);
+    } else if(command->opcode == OP_FUNCTION) {
+        runFunctionDefinition(shell, command);
+    } else if((function = calledFunction(shell, command)) != NULL) {
+        callFunction(shell, function, command);
+    } else if(isProgram(command, 0)) {
+        forkCommand(shell, command);
+    } else if(builtins[command->opcode].utility) {
+        runUtility(shell, command);
     } else {
-        if(displayCommand) {
-            printf("unset %s\n", argBuffer[1]);
-        }
+        runBuiltin(shell, command->opcode, expandCommand(shell, command),
+                command->argCount);
+    }
 
-        //struct variableHashStruct *copy = var;
-        fprintf(stderr, "var val: %s\n", var->value);
+    --shell->commandDepth;
 
-        // Delete/clear the struct
-        var->id[0] = 0;
-        var->value[0] = 0;
+    if(tracing) {
+        struct variableHashStruct *status = findVar(&shell->localVars, "?");
 
-        fprintf(stderr, "var val: %s\n", var->value);
+        traceSpan("command", commandText(&shell->commandArena, command),
+                start, 0, status != NULL ? atoi(status->value) : -1);
     }
 }
 
 
 
 /*
- * Called once at the start of the program. This
- * sets the default values for $$, $!, and $?.
+ * Orders line costs by wall time, most expensive first
  */
-void setBasicEnvVar() {
-    // $ - PID of shell
-    // Getting the pid as a string
-    int mainPID = getpid();
-    int lengthOfPID = lengthOfInt(mainPID);
-    char pidBuffer[lengthOfPID + 1];
-    sprintf(pidBuffer, "%d", mainPID);
-    setLocalVar("$", pidBuffer);
-
-    // ? - Decimal value returned by last foreground process
-    setLocalVar("?", "-1");
+static int compareLineCosts(const void *a, const void *b) {
+    double wallA = ((struct lineCost *) a)->total.wall;
+    double wallB = ((struct lineCost *) b)->total.wall;
 
-    // ! - PID of last background process
-    setLocalVar("!", "-1");
+    return (wallA < wallB) - (wallA > wallB);
 }
 
 
 
 /*
- * Catches Ctrl-C to only kill the foreground process.
- *
- * Tutorial:
- * http://www.geeksforgeeks.org/write-a-c-program-that-doesnt-terminate-when
- * -ctrlc-is-pressed/
+ * Prints the lines of the -f file that took the longest, for -T.
+ * Runs once, either after the file or from exit.
  */
-void signalTrap(){
-    signal(SIGINT, signalTrap);
+void printLineCosts(struct interpreter *shell) {
+    struct lineCost *lineCosts = shell->lineCosts;
+    int i;
 
-    if(foregroundPID != -1) {
-        // Terminate the foreground process
-        kill(foregroundPID, SIGKILL);
+    if(lineCosts == NULL) {
+        return;
     }
 
-    fprintf(stderr, "Got ctrl-c\n");
+    qsort(lineCosts, shell->numLineCosts, sizeof(struct lineCost),
+            compareLineCosts);
 
-    if(displayCommand) {
-        printf("Ctr-C");
+    fprintf(stderr, "%6s %6s %10s %10s %10s %10s  %s\n", "line", "runs",
+            "real", "user", "sys", "maxrss", "command");
+
+    for(i = 0; i < shell->numLineCosts && i < MAX_COST_LINES; ++i) {
+        struct lineCost *line = &lineCosts[i];
+
+        // Never got to finish, like the exit that ended the file
+        if(line->runs == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%6d %6d %9.3fs %9.3fs %9.3fs %7ld KB  %s\n",
+                line->lineNumber, line->runs, line->total.wall,
+                line->total.user, line->total.sys, line->total.maxRss,
+                line->text);
     }
 
-    printf("\n>> ");
-    fflush(stdout);
+    free(lineCosts);
+    shell->lineCosts = NULL;
 }
 
 
 
 /*
- * Replaces any variables in a command with its value.
+ * Runs every command of a parsed script in order.
+ * The command arena is reset after each one.
+ * With -T each line's cost is added up for printLineCosts.
  */
-void subVar() {
-    int i;
-
-    for(i = 0; i < argCount; ++i) {
-        if(argBuffer[i][0] == '$') {
-            // Found a replaceable variable
-
-            // Removing the $
-            char * searchId = malloc(sizeof(char) * strlen
-                    (argBuffer[i]));
-            strncpy(searchId, argBuffer[i] + 1, strlen(argBuffer[i]));
-
-            struct variableHashStruct *var;
-            var = findLocalVar(searchId);
-
-            if(var != NULL) {
-                char * value = malloc(sizeof(char) * strlen(var->value)
-                        + 1);
-                strncpy(value, var->value, strlen(var->value) + 1);
-
-                free(argBuffer[i]);
-                argBuffer[i] = value;
-            } else{
-                // Check for global variables
-                char * result = getenv(searchId);
-
-                if(result != NULL) {
-                    char * value = malloc(sizeof(char) * strlen
-                            (result) + 1);
-                    strncpy(value, result, strlen(result) + 1);
+void runProgram(struct interpreter *shell, struct program *program) {
+    struct program *savedProgram = shell->program;
+    struct command *command;
+    struct costTimer timer;
+    struct commandCost cost;
+    int index = 0;
+
+    // Functions it defines keep pointing into it
+    shell->program = program;
+
+    if(timeLines) {
+        shell->numLineCosts = 0;
+        for(command = program->first; command != NULL;
+                command = command->next) {
+            ++shell->numLineCosts;
+        }
 
-                    free(argBuffer[i]);
-                    argBuffer[i] = value;
+        shell->lineCosts = (struct lineCost *) calloc(shell->numLineCosts + 1,
+                sizeof(struct lineCost));
+        for(command = program->first; command != NULL;
+                command = command->next) {
+            shell->lineCosts[index].lineNumber = command->lineNumber;
+            shell->lineCosts[index].text = commandText(&program->arena,
+                    command);
+            ++index;
+        }
+        index = 0;
+    }
 
-                } else {
-                    // Variable not found
-                    fprintf(stderr, "%s not found\n", argBuffer[i]);
-                }
+    for(command = program->first; command != NULL; command = command->next) {
+        if(shell->lineCosts != NULL) {
+            struct lineCost *line = &shell->lineCosts[index++];
+
+            startCost(shell, &timer);
+            runCommand(shell, command);
+            stopCost(shell, &timer, &cost);
+
+            ++line->runs;
+            line->total.wall += cost.wall;
+            line->total.user += cost.user;
+            line->total.sys += cost.sys;
+            line->total.voluntary += cost.voluntary;
+            line->total.involuntary += cost.involuntary;
+            if(cost.maxRss > line->total.maxRss) {
+                line->total.maxRss = cost.maxRss;
             }
-            free(searchId);
+        } else {
+            runCommand(shell, command);
         }
+        freeArgBuffer(shell);
+
+        // Reap background jobs as they finish
+        if(currentJob(&shell->jobs) != NULL) {
+            handleEvents(&shell->jobs, 0);
+            reportJobs(&shell->jobs, interactive);
+        }
+
+        checkMetrics();
     }
-}
 
+    shell->program = savedProgram;
+}
 
 
 
 /*
  * Reads in the different commands and processes them accordingly.
- * Internal and external commands are handled here.
+ * The line is parsed into the input arena and run, unless it is part
+ * of a block that hasn't seen its end yet. Then it waits for the rest
+ * of the block.
  */
-void processCommands() {
+void processCommands(struct interpreter *shell) {
+    struct command *command;
+    double start;
+
     // No input
-    if(strcmp(line, "\n") == 0 || line[0] == 0) {
+    if(strcmp(shell->line, "\n") == 0 || shell->line[0] == 0) {
+        freeArgBuffer(shell);
         return;
     }
 
     // Process the command
-    argCount = 1;
-    splitCommand(line, &argCount);
+    start = (tracing ? traceNow() : 0);
+    command = parseLine(&shell->inputArena, shell->line, 0);
+    traceSpan("parse", "parse", start, 0, -1);
+    freeArgBuffer(shell);
 
-    fprintf(stderr, "arg count: %d\n", argCount);
-
-    // if argBuffer is empty, continue
-    if(argBuffer == NULL || argBuffer == 0 || argCount == 0) {
-        freeArgBuffer();
+    if(command == NULL || addCommand(&shell->inputBlocks, &shell->inputArena,
+            command) > 0) {
         return;
     }
 
+    for(command = shell->inputBlocks.first; command != NULL;
+            command = command->next) {
+        runCommand(shell, command);
+        freeArgBuffer(shell);
+    }
 
-    // Run any internal commands
-    if(strcmp(argBuffer[0], "show") == 0) {
-        fprintf(stderr, "got show as input arg\n");
-
-        if(argCount < 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
+    initBlockParser(&shell->inputBlocks);
+    resetArena(&shell->inputArena);
+}
 
-        showVar(argBuffer, argCount);
-    } else if(strcmp(argBuffer[0], "set") == 0) {
-        fprintf(stderr, "got set as input arg\n");
-        //printf("got set as input arg\n");
 
-        if(argCount != 3) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
 
-        // Variable substitution
-        subVar();
 
-        if(displayCommand) {
-            printf("set %s %s\n", argBuffer[1], argBuffer[2]);
-        }
+// Left out when xssh.c is built into the benchmarks, see make bench
+#ifndef XSSH_NO_MAIN
 
-        setLocalVar(argBuffer[1], argBuffer[2]);
-    } else if(strcmp(argBuffer[0], "unset") == 0) {
-        fprintf(stderr, "got unset as input arg\n");
+// One -f file for -P, and how it ended
+struct poolScript {
+    char *path;
+    int numArgs;
+    char *args[MAX_ARGS];
+    int status;
+};
 
-        if(argCount != 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
+// The -P files, handed out to the threads in order
+struct scriptPool {
+    struct poolScript *scripts;
+    int numScripts;
+    int next;                   // first script no thread has taken
+    char *fileJobs;             // -j for every file
+    struct metrics *total;      // the shell's counters, not a thread's
+    pthread_mutex_t lock;
+};
 
-        // Variable substitution
-        subVar();
 
-        unsetVar(argBuffer);
-    } else if(strcmp(argBuffer[0], "export") == 0) {
-        fprintf(stderr, "got export as input arg\n");
 
-        if(argCount != 3) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
+/*
+ * printLineCosts for the shell's own script, when exit ends it
+ */
+static void printMainLineCosts() {
+    printLineCosts(&mainShell);
+}
 
-        // Variable substitution
-        subVar();
 
-        if(displayCommand) {
-            printf("export %s %s\n", argBuffer[1], argBuffer[2]);
-        }
 
-        // Create the evn variable string: name=value
-        char evnStr[2 * MAX_VAR_SIZE];
-        strcpy (evnStr, argBuffer[1]);
-        strcat (evnStr, "=");
-        strcat (evnStr, argBuffer[2]);
+/*
+ * Sets $1, $2... to the file's args
+ */
+static void setFileArgs(struct interpreter *shell, char **args, int count) {
+    int i;
 
-        if(putenv(evnStr) != 0) {
-            // Error has occurred
-            printf("Error: %s\n", strerror(errno));
-        }
+    for(i = 0; i < count; ++i) {
+        int varId = i + 1;
+        int lengthOfVarId = lengthOfInt(varId);
+        char varIdBuffer[lengthOfVarId + 1];
+        sprintf(varIdBuffer, "%d", varId);
+        setLocalVar(shell, varIdBuffer, args[i]);
+    }
 
-    } else if(strcmp(argBuffer[0], "unexport") == 0) {
-        fprintf(stderr, "got unexport as input arg\n");
+    shell->numArgs = count;
+}
 
-        if(argCount != 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
 
-        // Variable substitution
-        subVar();
 
-        if(displayCommand) {
-            printf("unexport %s\n", argBuffer[1]);
-        }
+/*
+ * path with the session's pid added, path.pid. It's kept until exit.
+ */
+static char *sessionPath(char *path) {
+    char *sessionPath = (char *) malloc(strlen(path) + 16);
 
-        if(unsetenv(argBuffer[1]) == -1) {
-            // Error has occurred
-            printf("Error: %s\n", strerror(errno));
-        }
+    sprintf(sessionPath, "%s.%d", path, (int) getpid());
+    return sessionPath;
+}
 
-    } else if(strcmp(argBuffer[0], "chdir") == 0) {
-        fprintf(stderr, "got chdir as input arg\n");
 
-        if(argCount != 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
 
-        // Variable substitution
-        subVar();
+/*
+ * Runs one -P file in an interpreter of its own. exit in the file only
+ * ends the file. Its output is line buffered, so lines of different
+ * files don't get mixed up.
+ */
+static void runPoolScript(struct scriptPool *pool, struct poolScript *file) {
+    struct interpreter shell;
+    struct program *script;
+    jmp_buf exitJump;
+    double traceStart;
+    int out;
+
+    initInterpreter(&shell, mainShell.env.entries, 1);
+    setBasicEnvVar(&shell);
+    setFileArgs(&shell, file->args, file->numArgs);
+
+    // Its own directory, for cd to move without moving the others
+    shell.cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(shell.cwd == -1) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        shell.cwd = AT_FDCWD;
+        file->status = 1;
+        freeInterpreter(&shell);
+        return;
+    }
 
-        if(displayCommand) {
-            printf("chdir %s\n", argBuffer[1]);
+    out = dup(1);
+    shell.out = (out == -1 ? NULL : fdopen(out, "w"));
+    if(shell.out == NULL) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        if(out != -1) {
+            close(out);
+        }
+        file->status = 1;
+        freeInterpreter(&shell);
+        return;
+    }
+    setvbuf(shell.out, NULL, _IOLBF, 0);
+    traceThread(file->path);
+
+    // -C isn't shared, two files could write the same cache at once
+    traceStart = (tracing ? traceNow() : 0);
+    script = loadScript(file->path, NULL);
+    traceSpan("parse", file->path, traceStart, 0, -1);
+
+    if(script == NULL) {
+        fprintf(stderr, "Error opening file %s: %s\n", file->path,
+                strerror(errno));
+        file->status = 1;
+    } else {
+        if(pool->fileJobs != NULL) {
+            parallelProgram(script, pool->fileJobs);
         }
 
-        if(chdir(argBuffer[1]) == -1) {
-            // Error has occurred
-            printf("Error: %s\n", strerror(errno));
+        file->status = 0;
+        shell.exitJump = &exitJump;
+        if(setjmp(exitJump) == 0) {
+            runProgram(&shell, script);
+        } else {
+            file->status = shell.exitCode;
         }
+        shell.exitJump = NULL;
 
-    } else if(strcmp(argBuffer[0], "exit") == 0) {
-        fprintf(stderr, "got exit as input arg\n");
+        printLineCosts(&shell);
+        freeProgram(script);
+    }
 
-        if(argCount != 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
-        }
+    fclose(shell.out);
+    freeInterpreter(&shell);
+}
 
-        // Variable substitution
-        subVar();
 
-        if(displayCommand) {
-            printf("exit %s\n", argBuffer[1]);
-        }
 
-        int exitCode = atoi(argBuffer[1]);
+/*
+ * A -P thread. Takes the next file nobody has started until there are
+ * none left, then adds its counters to the shell's.
+ */
+static void *poolThread(void *arg) {
+    struct scriptPool *pool = (struct scriptPool *) arg;
 
-        freeArgBuffer();
-        freeLocalVar();
-        free(line);
-        line = NULL;
-        exit(exitCode);
+    while(1) {
+        int index;
 
-    } else if(strcmp(argBuffer[0], "wait") == 0) {
-        fprintf(stderr, "got wait as input arg\n");
+        pthread_mutex_lock(&pool->lock);
+        index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
 
-        if(argCount != 2) {
-            printf("Incorrect number of arguments.\n");
-            freeArgBuffer();
-            return;
+        if(index >= pool->numScripts) {
+            break;
         }
 
-        // Variable substitution
-        subVar();
+        runPoolScript(pool, &pool->scripts[index]);
+    }
 
-        if(displayCommand) {
-            printf("wait %s\n", argBuffer[1]);
-        }
+    addMetrics(pool->total);
+    return NULL;
+}
 
-        int pid = atoi(argBuffer[1]);
-        int status = 0;
 
-        if(pid == -1) {
-            // Wait for any children
-            waitpid(-1, &status, 0);
-        } else {
-            // Wait for pid
-            waitpid(pid, &status, 0);
-        }
 
-    } else {
-        // Variable substitution
-        subVar();
+/*
+ * -P, runs every file at the same time on one thread per CPU (or one
+ * per file, if that's fewer). Returns the status of the first file,
+ * in command line order, that didn't end with 0.
+ */
+static int runPool(struct poolScript *scripts, int numScripts,
+        char *fileJobs) {
+    struct scriptPool pool;
+    pthread_t *threads;
+    long numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    sigset_t interrupt;
+    int i;
 
-        // Process an external command
-        forkCommand(argBuffer[0], argBuffer, argCount);
+    if(numThreads < 1) {
+        numThreads = 1;
+    }
+    if(numThreads > numScripts) {
+        numThreads = numScripts;
     }
 
-    freeArgBuffer();
-}
+    pool.scripts = scripts;
+    pool.numScripts = numScripts;
+    pool.next = 0;
+    pool.fileJobs = fileJobs;
+    pool.total = &metrics;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // A closed pipe is an error for that file's command, not the end of
+    // every file. Ctrl-C does end them all, there is no one job to stop.
+    pooled = 1;
+    interactive = 0;
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &interrupt, NULL);
+    signal(SIGINT, SIG_DFL);
+
+    LOG(LOG_DEBUG, "running %d files on %ld threads\n", numScripts,
+            numThreads);
+
+    threads = (pthread_t *) malloc(sizeof(pthread_t) * numThreads);
+    for(i = 0; i < numThreads; ++i) {
+        pthread_create(&threads[i], NULL, poolThread, &pool);
+    }
+    for(i = 0; i < numThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+
+    for(i = 0; i < numScripts; ++i) {
+        if(scripts[i].status != 0) {
+            return scripts[i].status;
+        }
+    }
 
+    return 0;
+}
 
 
 
 int main(int argc, char *argv[]) {
     int opt;                    // Command line arguments for xssh
-    int debugLevel = 1;         // 1 = print debug, 0 = don't print
-    size_t size;
+    char *end;                  // Past a number in an option
+    int debugLevel = LOG_INFO;  // 0 = no messages, up to LOG_TRACE
     int i;
+    int readStdin = 0;          // stdin isn't a terminal, use stdinReader
 
     // For file reading
     char *commandFile = "";
+    char *cacheFile = NULL;     // Where to keep the parsed file, -C
+    char *fileJobs = NULL;      // Jobs to run the file with at once, -j
+    char *metricsFile = NULL;   // Where to dump the metrics, --metrics-file
+    int metricsInterval = 0;    // Seconds between dumps, 0 = default
+    char *traceFile = NULL;     // Chrome trace of every command, --trace
+    char *serveSocket = NULL;   // Run sessions for clients, --serve
+    char *clientSocket = NULL;  // Hand the file to a server, --client
+    struct serveRequest request;
+    double traceStart;
     int numFileArgs = 0;        // number of command line args for the file
     char *fileArgs[MAX_ARGS];   // $Vars to be set for the file to use
+    int usePool = 0;            // -P, every -f script on its own thread
+    struct poolScript *scripts = NULL;
+    int numScripts = 0;
 
-    // Set up Local variable array
-    localVars = (struct variableHashStruct **)
-            malloc(sizeof(struct variableHashStruct *) * numLocalVars);
+    // Set up Local variable table, and our own copy of the environment
+    initInterpreter(&mainShell, environ, 0);
 
-    // Catching Ctrl-C
-    signal(SIGINT, &signalTrap);
+    // Catching Ctrl-C and children exiting
+    interactive = isatty(0);
+    initJobs(interactive);
 
     // Set $$, $!, and $?
-    setBasicEnvVar();
+    setBasicEnvVar(&mainShell);
 
 
     // Read in the options from the command line
-    while ((opt = getopt(argc, argv, "xd:f:")) != -1) {
+    static struct option longOptions[] = {
+        {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+        {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"client", required_argument, NULL, OPT_CLIENT},
+        {"subst-limit", required_argument, NULL, OPT_SUBST_LIMIT},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "xd:f:s:C:j:TEP", longOptions,
+            NULL)) != -1) {
         switch (opt) {
 
             case 'x':           // Display the command to be run
@@ -792,115 +3156,306 @@ int main(int argc, char *argv[]) {
                 debugLevel = atoi(optarg);
                 break;
 
+            case 's':           // Spawn method for external commands
+                if(strcmp(optarg, "fork") == 0) {
+                    spawnMode = SPAWN_FORK;
+                } else if(strcmp(optarg, "vfork") == 0) {
+                    spawnMode = SPAWN_VFORK;
+                } else if(strcmp(optarg, "spawn") == 0) {
+                    spawnMode = SPAWN_POSIX;
+                } else if(strcmp(optarg, "zygote") == 0) {
+                    spawnMode = SPAWN_ZYGOTE;
+                } else {
+                    printf("Unknown spawn method: %s\n", optarg);
+                    return 0;
+                }
+                break;
+
+            case 'C':           // Cache the parsed file here
+                cacheFile = optarg;
+                break;
+
+            case 'T':           // Time each line of the file
+                timeLines = 1;
+                break;
+
+            case 'E':           // Real programs for echo, cat etc.
+                externalUtilities = 1;
+                break;
+
+            case 'P':           // Run the -f scripts at the same time
+                usePool = 1;
+                break;
+
+            case 'j':           // Run the file's commands N at a time
+                if(atoi(optarg) < 1) {
+                    printf("Bad number of jobs: %s\n", optarg);
+                    return 0;
+                }
+                fileJobs = optarg;
+                break;
+
+            case OPT_METRICS_FILE:      // Dump the metrics here
+                metricsFile = optarg;
+                break;
+
+            case OPT_METRICS_INTERVAL:  // Every this many seconds
+                metricsInterval = atoi(optarg);
+                if(metricsInterval < 1) {
+                    printf("Bad metrics interval: %s\n", optarg);
+                    return 0;
+                }
+                break;
+
+            case OPT_TRACE:             // Trace every command here
+                traceFile = optarg;
+                break;
+
+            case OPT_SERVE:             // Take sessions on this socket
+                serveSocket = optarg;
+                break;
+
+            case OPT_CLIENT:            // Run in the server on this socket
+                clientSocket = optarg;
+                break;
+
+            case OPT_SUBST_LIMIT:       // Most a $(...) keeps, in bytes
+                substLimit = strtoul(optarg, &end, 10);
+                if(end == optarg || *end != 0 || substLimit == 0) {
+                    printf("Bad substitution limit: %s\n", optarg);
+                    return 0;
+                }
+                break;
+
             case 'f':           // Option to input file
                 commandFile = optarg;
 
                 int index = optind;                     // Index of opt
                 int fileArgIndex = 0;
-                while(index < argc){
-                    char * next = strdup(argv[index]);  // Get arg
-                    index++;
-
-                    if(next[0] != '-'){     // check if optarg is next switch
-                        fileArgs[fileArgIndex++] = next;
-                        ++numFileArgs;
-                    } else {
-                        optind = index - 1;
-                        break;
+                while(index < argc && argv[index][0] != '-'){
+                    // Room for the NULL after them
+                    if(fileArgIndex == MAX_ARGS - 1) {
+                        printf("Too many args for %s, at most %d\n",
+                                commandFile, MAX_ARGS - 1);
+                        return 0;
                     }
+                    fileArgs[fileArgIndex++] = strdup(argv[index]);
+                    index++;
                 }
-                optind = index - 1;
+                optind = index;
+
+                // Only -P runs more than one file, each with its own args
+                numFileArgs = fileArgIndex;
+
+                // Every -f is a script of its own for -P
+                scripts = (struct poolScript *) realloc(scripts,
+                        sizeof(struct poolScript) * (numScripts + 1));
+                scripts[numScripts].path = commandFile;
+                scripts[numScripts].numArgs = fileArgIndex;
+                memcpy(scripts[numScripts].args, fileArgs,
+                        sizeof(char *) * fileArgIndex);
+                ++numScripts;
                 break;
 
             default: /* '?' */
                 printf("Usage: \n"
                         "\t\"-x\" Used to see the command to be run\n"
                         "\t\"-d <DebugLevel>\" Debug level 0 for no "
-                        "messages\n \t\t\tDebug level = 1 to see messages\n"
+                        "messages\n \t\t\tDebug level = 1 to see messages,"
+                        " 2 for every command, 3 for every token\n"
                         "\t\"-f <file> <args>\" Input is from a file "
-                        "instead of stdin.");
+                        "instead of stdin.\n"
+                        "\t\"-s <fork|vfork|spawn|zygote>\" How external "
+                        "commands are started (default spawn)\n"
+                        "\t\"-C <cachefile>\" Keep the parsed file here "
+                        "for the next run\n"
+                        "\t\"-j <jobs>\" Run the file's commands in "
+                        "parallel, this many at a time\n"
+                        "\t\"-T\" Time each line of the file, the most "
+                        "expensive ones are listed at the end\n"
+                        "\t\"-E\" Run echo, true, false, test, [, pwd, "
+                        "sleep and cat as programs, not in the shell\n"
+                        "\t\"-P -f <file> <args> -f <file> ...\" Run "
+                        "every file at the same time, one thread per CPU\n"
+                        "\t\"--metrics-file <file>\" Keep the shell's "
+                        "metrics in this file for Prometheus\n"
+                        "\t\"--metrics-interval <seconds>\" How often "
+                        "the metrics file is rewritten (default 15)\n"
+                        "\t\"--trace <file>\" Write a Chrome trace of "
+                        "every command and job\n"
+                        "\t\"--serve <socket>\" Run the scripts and "
+                        "commands of clients on this socket\n"
+                        "\t\"--client <socket>\" Run the file (or stdin) "
+                        "in the server on this socket\n"
+                        "\t\"--subst-limit <bytes>\" Most output a "
+                        "$(command) keeps (default 16M)\n");
                 return 0;
         }
     }
 
 
-    if(debugLevel == 0) {
-        // Don't output debug messages
-        freopen("/dev/null", "w", stderr);
+    if(!usePool && numScripts > 1) {
+        printf("Only one file (-f) without -P\n");
+        return 0;
+    }
+
+    // Nothing runs here, the server does it all
+    if(usePool && (numScripts == 0 || serveSocket != NULL
+            || clientSocket != NULL)) {
+        printf("-P needs files (-f) and can't serve or be a client\n");
+        return 0;
+    }
+
+    if(clientSocket != NULL) {
+        return runClient(clientSocket, commandFile, numFileArgs, fileArgs);
+    }
+
+    // Messages below the level are never even formatted
+    initLog(debugLevel);
+
+    // Only comes back in a session's own fork of the shell, talking to
+    // its client through stdin, stdout and stderr
+    if(serveSocket != NULL) {
+        serveClients(serveSocket, &request);
+
+        interactive = 0;
+        freeEnv(&mainShell.env);
+        initEnv(&mainShell.env, request.env, 1, &mainShell.names);
+        free(request.env);
+        setBasicEnvVar(&mainShell);
+
+        commandFile = (request.numArgs > 0 ? request.args[0] : "");
+        numFileArgs = 0;
+        for(i = 1; i < request.numArgs; ++i) {
+            fileArgs[numFileArgs++] = request.args[i];
+        }
+
+        // Sessions run side by side, one file each so they don't
+        // truncate or replace each other's
+        if(traceFile != NULL) {
+            traceFile = sessionPath(traceFile);
+        }
+        if(metricsFile != NULL) {
+            metricsFile = sessionPath(metricsFile);
+        }
+    }
+
+    // Forked now, while the shell is still small, programs are started
+    // from there instead of from the shell
+    if(spawnMode == SPAWN_ZYGOTE && startZygote() == -1) {
+        printf("Can't start the zygote: %s\n", strerror(errno));
+        spawnMode = SPAWN_POSIX;
     }
 
     if(displayCommand) {
-        fprintf(stderr, "got x\n");
+        LOG(LOG_DEBUG, "got x\n");
     }
 
-    fprintf(stderr, "debug level: %d \n", debugLevel);
+    LOG(LOG_INFO, "debug level: %d \n", debugLevel);
 
+    if(metricsFile != NULL) {
+        initMetrics(metricsFile, metricsInterval);
+    }
 
-    // Set the file args
-    for(i = 0; i < numFileArgs; ++i) {
-        int varId = i + 1;
-        int lengthOfVarId = lengthOfInt(varId);
-        char varIdBuffer[lengthOfVarId + 1];
-        sprintf(varIdBuffer, "%d", varId);
-        setLocalVar(varIdBuffer, fileArgs[i]);
+    if(traceFile != NULL && initTrace(traceFile) == -1) {
+        printf("Can't write trace %s: %s\n", traceFile, strerror(errno));
+        return 0;
+    }
+
+
+    // Every file on its own thread, no prompt after them
+    if(usePool) {
+        int status = runPool(scripts, numScripts, fileJobs);
+
+        for(i = 0; i < numScripts; ++i) {
+            int j;
+
+            for(j = 0; j < scripts[i].numArgs; ++j) {
+                free(scripts[i].args[j]);
+            }
+        }
+        free(scripts);
+        freeLocalVar();
+        return status;
     }
+    free(scripts);
+
+    // Set the file args
+    setFileArgs(&mainShell, fileArgs, numFileArgs);
 
 
     // Run the commands in the given file
     if(commandFile[0] != '\0') {
-        fprintf(stderr, "got file\n");
+        LOG(LOG_DEBUG, "got file\n");
 
-        FILE* fr = fopen(commandFile, "rt");
+        // Parse the whole file once, then do the shell things!
+        traceStart = (tracing ? traceNow() : 0);
+        struct program *script = loadScript(commandFile, cacheFile);
+        traceSpan("parse", commandFile, traceStart, 0, -1);
 
-        if(fr == NULL) {
+        if(script == NULL) {
             perror("Error opening file.");
             freeLocalVar();
             return(-1);
         }
 
-        line = (char*) malloc(MAX_LINE_SIZE * sizeof(char));
+        if(fileJobs != NULL) {
+            parallelProgram(script, fileJobs);
+        }
 
-        while(fgets(line, MAX_LINE_SIZE, fr) != NULL) {
-            // do the rest of the parsing and shell things!
-            processCommands();
+        if(timeLines) {
+            // The file may end with exit
+            atexit(printMainLineCosts);
         }
 
-        free(line);
-        line = NULL;
+        runProgram(&mainShell, script);
+        printLineCosts(&mainShell);
+        freeProgram(script);
     }
 
     // Command line prompt
     printf(">> ");
 
+    // Piped or redirected input is read in big blocks (or mapped)
+    // instead of a line at a time
+    if(!isatty(0)) {
+        openReader(&stdinReader, 0);
+        readStdin = 1;
+    }
+
     // Run the commands from command line
-    int readLineResult = 0;
-    while((readLineResult = getline(&line, &size, stdin)) >= -1) {
+    while(1) {
+        if(readStdin) {
+            mainShell.line = readStdinLine();
+        } else {
+            // Let jobs finish and Ctrl-C work while sitting here
+            waitForInput(&mainShell.jobs, 0);
+            mainShell.line = readLine(&mainShell, stdin);
+        }
 
-        if(readLineResult == -1) {
+        if(mainShell.line == NULL) {
             printf("Error: %s\n", strerror(errno));
 
             // Got a bad input, so you should just quit now
             freeLocalVar();
-
-            if(line != NULL) {
-                free(line);
-                line = NULL;
+            if(readStdin) {
+                closeReader(&stdinReader);
             }
 
            return -1;
         } else {
-            processCommands();
+            processCommands(&mainShell);
         }
 
-        if(line != NULL) {
-            free(line);
-            line = NULL;
-        }
+        handleEvents(&mainShell.jobs, 0);
+        reportJobs(&mainShell.jobs, interactive);
+        checkMetrics();
 
-        // Command line prompt
-        printf(">> ");
+        // Command line prompt, a different one inside a block
+        printf(mainShell.inputBlocks.depth > 0 ? "> " : ">> ");
     }
 
     freeLocalVar();
     return 0;
 }
+#endif /* XSSH_NO_MAIN */
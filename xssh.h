@@ -1,13 +1,578 @@
 #ifndef _XSSH_H
 #define _XSSH_H
 
-//#include "uthash.h"
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/*
+ * Debug logging. -d <level> picks the most detailed messages shown,
+ * the level is checked before anything gets formatted. Building with
+ * XSSH_NO_LOG defined (make NOLOG=1) leaves every message out.
+ */
+#define LOG_NONE 0
+#define LOG_INFO 1              /* what the shell is doing */
+#define LOG_DEBUG 2             /* every builtin and parsed line */
+#define LOG_TRACE 3             /* every token */
+
+#ifdef XSSH_NO_LOG
+#define LOG_ENABLED(level) 0
+#else
+#define LOG_ENABLED(level) ((level) <= logLevel)
+#endif
+
+#define LOG(level, ...) do { \
+        if(LOG_ENABLED(level)) { \
+            logMessage(__VA_ARGS__); \
+        } \
+    } while(0)
+
+// 16 + 1 for null character
+#define MAX_ARGS 17
+// Words on a line, for all of its ;-separated commands
+#define MAX_LINE_WORDS 256
 #define MAX_VAR_SIZE 256
+#define MAX_LINE_SIZE 256
+
+// Values shorter than this are kept inside the variable itself
+#define VAR_INLINE_SIZE 24
 
+/*
+ * A variable. Names are interned, the tables of an interpreter share
+ * one copy of each name for as long as a variable has it. Short values live in
+ * inlineValue, longer ones are malloc'd at their own size, so there
+ * is no length limit.
+ */
 struct variableHashStruct {
-    char id[MAX_VAR_SIZE];          /* key */
-    char value[MAX_VAR_SIZE];
-    //UT_hash_handle hh;              /* makes this structure hashable */
+    const char *id;                 /* key, interned */
+    char *value;                    /* inlineValue or its own block */
+    unsigned int capacity;          /* bytes value has room for */
+    int envIndex;                   /* entry in env->entries, -1 for none */
+    char inlineValue[VAR_INLINE_SIZE];
+};
+
+/*
+ * Interned variable names, hashed into buckets. A name is freed when
+ * the last variable with it goes. Every interpreter has its own, so
+ * -P scripts never wait on each other for one.
+ */
+struct internedName;
+
+struct nameSet {
+    struct internedName **buckets;
+    unsigned int capacity;          /* number of buckets, power of two */
+    unsigned int count;             /* names in it */
+};
+
+/*
+ * Open addressing hash table of variables. The slots only hold
+ * pointers, so growing the table never copies the variables.
+ */
+struct variableSlot {
+    unsigned int hash;                  /* cached hash of var->id */
+    struct variableHashStruct *var;     /* NULL = empty slot */
+};
+
+struct variableTable {
+    struct nameSet *names;          /* where its names are interned */
+    struct variableSlot *slots;
+    unsigned int capacity;          /* number of slots, power of two */
+    unsigned int count;             /* live variables */
+    unsigned int deleted;           /* slots left behind by unset */
+};
+
+/*
+ * Bump allocator for memory that only lives as long as one command:
+ * the line, its tokens and anything substituted into them.
+ * resetArena throws all of it away at once.
+ */
+struct arenaBlock;
+
+struct arena {
+    char *base;                     /* main block */
+    size_t size;
+    size_t used;
+    char *last;                     /* most recent allocation in base */
+    struct arenaBlock *extra;       /* overflow blocks, freed on reset */
+    size_t extraUsed;
+    size_t highWater;               /* most bytes one command has used */
+    unsigned long resets;
+    unsigned long overflows;        /* allocations that missed base */
+};
+
+/*
+ * Internal commands are resolved to one of these when a line is
+ * parsed, OP_EXTERNAL means the command is a program to start.
+ */
+enum opcode {
+    OP_EXTERNAL,
+    OP_SHOW,
+    OP_SET,
+    OP_UNSET,
+    OP_EXPORT,
+    OP_UNEXPORT,
+    OP_HASH,
+    OP_MEMSTAT,
+    OP_CHDIR,
+    OP_EXIT,
+    OP_WAIT,
+    OP_JOBS,
+    OP_FG,
+    OP_BG,
+    OP_STATS,
+    OP_SOURCE,
+    OP_ECHO,                /* utilities, see struct builtin */
+    OP_TRUE,
+    OP_FALSE,
+    OP_TEST,
+    OP_BRACKET,             /* [ ... ], same as test */
+    OP_PWD,
+    OP_SLEEP,
+    OP_CAT,
+    OP_TIME,                /* times the command in its body */
+    OP_PARALLEL,            /* runs its body with a limit on jobs */
+    OP_END,                 /* closes a block, never run itself */
+    OP_IF,                  /* runs its body or elseBody on a condition */
+    OP_THEN,                /* keywords only, dropped by addCommand */
+    OP_ELSE,
+    OP_FI,
+    OP_WHILE,               /* runs its body while a condition holds */
+    OP_DO,
+    OP_DONE,
+    OP_FOR,                 /* runs its body once for each word */
+    OP_FUNCTION,            /* defines a function, its body is the code */
+    OP_FUNCTION_END,        /* } */
+    OP_ERROR,               /* line couldn't be parsed, args[0] says why */
+    NUM_OPCODES
+};
+
+/*
+ * What the shell knows about each builtin, indexed by opcode.
+ * Utilities are builtins that are also programs. They run in the
+ * shell when they are a command of their own, and as the program
+ * when they are part of a pipeline, in the background, in a parallel
+ * block, or with -E.
+ */
+struct builtin {
+    const char *name;
+    int utility;
 };
 
+extern const struct builtin builtins[NUM_OPCODES];
+
+/*
+ * One word of a parsed command. Words with a $variable in them are
+ * flagged so substitution doesn't have to look at the rest again.
+ */
+struct word {
+    char *text;
+    int isVar;              /* text has a $ somewhere */
+};
+
+/*
+ * A parsed command line. Pipelines are a chain of stages through
+ * pipeNext, scripts are a chain of commands through next. Blocks
+ * like parallel hold the commands up to their end in body.
+ */
+struct command {
+    int opcode;
+    int argCount;
+    struct word *args;          /* args[0] is the command name */
+    struct word *fileIn;        /* < file, NULL for none */
+    struct word *fileOut;       /* > file, NULL for none */
+    int background;             /* & (set on the first stage) */
+    int lineNumber;
+    struct command *pipeNext;   /* next stage of a pipeline */
+    struct command *next;       /* next command in the script */
+    struct command *body;       /* commands inside a block */
+    struct command *condition;  /* of an if or while, decided by $? */
+    struct command *elseBody;   /* an if's commands after else */
+    int cacheIndex;             /* scratch for writing the cache file */
+};
+
+/*
+ * A word of a line, as tokenizeLine finds it
+ */
+struct token {
+    unsigned int start;             /* offset into the line */
+    unsigned int length;
+};
+
+// How tokenizeLine looks for the ends of words
+enum tokenizerKind {
+    TOKENIZER_SCALAR,               /* a byte at a time */
+    TOKENIZER_SSE2,                 /* 16 bytes at a time */
+    TOKENIZER_AVX2                  /* 32 bytes at a time */
+};
+
+/*
+ * A whole parsed script, everything in it lives in its arena.
+ * Functions defined in it and the source cache hold on to it too, it's
+ * freed when the last of them lets go.
+ */
+struct program {
+    struct command *first;
+    struct arena arena;
+    int refs;
+};
+
+/*
+ * A function, run in the shell when a command has its name. The body
+ * isn't copied, it stays in the program it was parsed into.
+ */
+#define FUNCTION_TABLE_SIZE 64
+
+struct function {
+    char *name;
+    struct command *body;
+    struct program *program;        /* holds the body */
+    struct function *next;          /* next in the bucket */
+};
+
+/*
+ * Puts parsed lines together into a script, nesting the commands
+ * between a block's first line and its end into the block's body.
+ */
+#define MAX_BLOCK_DEPTH 32
+
+struct blockParser {
+    struct command *first;                      /* top level commands */
+    struct command *open[MAX_BLOCK_DEPTH];      /* blocks waiting for end */
+    struct command *last[MAX_BLOCK_DEPTH + 1];  /* last command at each depth */
+    int inElse[MAX_BLOCK_DEPTH];                /* past an if's else */
+    int depth;
+};
+
+/*
+ * A pipeline the shell started, in the foreground or the background.
+ * Jobs are kept in a list in the order they were started, and each
+ * running stage is in a pid table so an exited child finds its job
+ * without a scan.
+ */
+struct job;
+
+struct jobProcess {
+    pid_t pid;                      /* 0 for builtins and reaped stages */
+    struct job *job;
+    struct jobProcess *hashNext;    /* next in the pid table bucket */
+    char *fileOut;                  /* > file, to count what it wrote */
+    off_t outStart;                 /* its size when the stage started */
+    int pidFd;                      /* to poll on when reaping by pid */
+    unsigned int pollIndex;         /* of pidFd in the table's pollFds */
+};
+
+struct job {
+    int id;                         /* job number, 0 until addJob */
+    pid_t pgid;                     /* own process group, 0 = the shell's */
+    pid_t lastPid;                  /* of the last stage started, for $! */
+    struct jobProcess procs[MAX_ARGS];
+    int numStages;
+    int running;                    /* stages not reaped yet */
+    int status;                     /* of the last stage, once it's known */
+    int background;
+    int stopped;
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;            /* of the stages reaped so far */
+    char *command;                  /* the line, for jobs */
+    struct job *prev;
+    struct job *next;
+    int pendingReport;              /* finished in the background */
+    struct job *donePrev;           /* list of those */
+    struct job *doneNext;
+};
+
+/*
+ * Every job one interpreter started. The shell's own table reaps any
+ * child that exits, through the signalfd. The tables of -P scripts
+ * share the process with each other, so they only ever wait for their
+ * own pids.
+ */
+struct jobTable {
+    struct job *firstJob;           /* oldest first */
+    struct job *lastJob;
+    struct job *firstDone;          /* finished, not reported yet */
+    struct jobProcess **pidTable;   /* pid -> stage, through hashNext */
+    unsigned int pidCapacity;
+    unsigned int pidCount;
+    struct pollfd *pollFds;         /* by pid: every stage's pidFd */
+    struct jobProcess **pollProcs;  /* and the stage it's for */
+    unsigned int pollCount;
+    unsigned int pollCapacity;
+    struct job *foregroundJob;      /* Ctrl-C kills it */
+    int interrupted;                /* Ctrl-C's seen, loops stop on one */
+    int byPid;                      /* reap only the pids in here */
+};
+
+/*
+ * Counters for stats and --metrics-file. Plain integers, every thread
+ * has its own set; -P scripts add theirs to the shell's when they end.
+ */
+#define NUM_SPAWN_BUCKETS 13
+
+struct metrics {
+    unsigned long commands;
+    unsigned long builtins;
+    unsigned long forks;            /* children we tried to start */
+    unsigned long execs;            /* programs that started */
+    unsigned long execFailures;
+    unsigned long varLookups;
+    unsigned long varMisses;
+    unsigned long bytesIn;          /* size of < files */
+    unsigned long bytesOut;         /* growth of > files */
+    unsigned long spawnBuckets[NUM_SPAWN_BUCKETS];
+    unsigned long spawnCount;
+    double spawnSeconds;
+};
+
+/*
+ * Hands out the lines of a script or of stdin. Regular files are
+ * mmap'd, everything else is read in big blocks. Lines are cut in
+ * place, so nothing is copied and there is no length limit.
+ */
+struct scriptReader {
+    int fd;
+    char *data;                 /* the mapping, or the read buffer */
+    size_t length;              /* bytes in data */
+    size_t pos;                 /* where the next line starts */
+    size_t capacity;            /* size of the read buffer */
+    off_t start;                /* file offset the mapped lines start at */
+    int mapped;
+    int eof;
+    int hadNewline;             /* last line handed out ended with \n */
+    char *spill;                /* copy of a mapped last line */
+};
+
+/*
+ * One program to start, a pipeline has one of these per stage
+ */
+struct spawnRequest {
+    char **args;                /* args[0] is the program, NULL terminated */
+    int argCount;
+    char *fileIn;               /* < file, NULL for none */
+    char *fileOut;              /* > file, NULL for none */
+    int inFd;                   /* pipe end to use as stdin, -1 for none */
+    int outFd;                  /* pipe end to use as stdout, -1 for none */
+    int background;             /* run in its own process group */
+    pid_t pgid;                 /* group to join when background, 0 = new */
+    char **env;                 /* NAME=VALUE strings it gets */
+    int cwd;                    /* directory to run in, AT_FDCWD = ours */
+};
+
+/*
+ * What an --serve session was asked to run, the script and its args.
+ * No args means the session reads commands from the client's stdin.
+ */
+struct serveRequest {
+    int numArgs;
+    char *args[MAX_ARGS];
+    char **env;                 /* the client's, NULL terminated */
+};
+
+/*
+ * Exported variables and the NAME=VALUE array handed to the programs
+ * an interpreter starts. The shell's own one is also environ.
+ */
+struct environment {
+    struct variableTable vars;      /* each knows its entry */
+    char **entries;                 /* NULL terminated */
+    int count;
+    int capacity;
+    int isEnviron;                  /* keep environ pointing at entries */
+};
+
+/*
+ * Everything one running script needs of its own. The shell runs in
+ * one of these, and -P gives every script its own on its own thread.
+ * Options from the command line stay global, they never change.
+ */
+struct lineCost;
+struct capture;
+
+struct interpreter {
+    struct nameSet names;           /* of all of its variables */
+    struct variableTable localVars;
+    struct variableTable commandPaths;  /* program -> path, see hash */
+    struct environment env;
+    struct jobTable jobs;
+    char *line;                     /* line being run */
+    struct arena commandArena;      /* the line and what's expanded */
+    struct arena inputArena;        /* typed blocks, until their end */
+    struct blockParser inputBlocks;
+    FILE *out;                      /* builtins write here, > changes it */
+    int in;                         /* utilities read here, < changes it */
+    int cwd;                        /* AT_FDCWD, or -P's own directory */
+    struct rusage childUsage;       /* jobs waited on, for time and -T */
+    struct lineCost *lineCosts;     /* -T, per line of the script */
+    int numLineCosts;
+    int exitCode;                   /* of exit, when exitJump is set */
+    jmp_buf *exitJump;              /* where exit goes instead, for -P */
+    struct capture *capture;        /* $(...) being run, NULL for none */
+    struct program *program;        /* being run, NULL for typed lines */
+    int numArgs;                    /* $1... that are set */
+    int commandDepth;               /* runCommand calls under way */
+    struct function *functions[FUNCTION_TABLE_SIZE];
+    int numFunctions;
+};
+
+
+/* xssh.c */
+extern int displayCommand;
+extern size_t substLimit;
+int setupChildFds(struct spawnRequest *request);
+void initInterpreter(struct interpreter *shell, char **env, int byPid);
+void freeInterpreter(struct interpreter *shell);
+char *currentDirectory(struct interpreter *shell, char *buffer, size_t size);
+struct variableHashStruct *findLocalVar(struct interpreter *shell,
+        char *id);
+void setLocalVar(struct interpreter *shell, char *id, char *value);
+void freeArgBuffer(struct interpreter *shell);
+void splitCommand(char *line, char **argBuffer, int *argCount);
+int runBuiltin(struct interpreter *shell, int opcode, char **argBuffer,
+        int argCount);
+void subVar(struct interpreter *shell, struct word *words, int count,
+        char **argBuffer);
+char *expandText(struct interpreter *shell, const char *text,
+        int *missing);
+char *expandWord(struct interpreter *shell, struct word *word);
+char **expandCommand(struct interpreter *shell, struct command *command);
+int forkCommand(struct interpreter *shell, struct command *pipeline);
+void runParallel(struct interpreter *shell, struct command *block);
+void runCommand(struct interpreter *shell, struct command *command);
+void runProgram(struct interpreter *shell, struct program *program);
+void processCommands(struct interpreter *shell);
+
+/* vars.c */
+void initNameSet(struct nameSet *names);
+void freeNameSet(struct nameSet *names);
+void initVarTable(struct variableTable *table, struct nameSet *names);
+void freeVarTable(struct variableTable *table);
+struct variableHashStruct *findVar(struct variableTable *table,
+        const char *id);
+struct variableHashStruct *setVar(struct variableTable *table,
+        const char *id, const char *value);
+int removeVar(struct variableTable *table, const char *id);
+struct variableHashStruct *nextVar(struct variableTable *table,
+        unsigned int *index);
+
+/* arena.c */
+void initArena(struct arena *arena, size_t size);
+void freeArena(struct arena *arena);
+void *arenaAlloc(struct arena *arena, size_t size);
+void *arenaGrow(struct arena *arena, void *ptr, size_t oldSize,
+        size_t newSize);
+char *arenaStrdup(struct arena *arena, const char *str);
+void resetArena(struct arena *arena);
+
+/* reader.c */
+void openReader(struct scriptReader *reader, int fd);
+void closeReader(struct scriptReader *reader);
+char *nextLine(struct scriptReader *reader, size_t *length);
+
+/* utils.c */
+int echoUtility(struct interpreter *shell, char **args, int argCount);
+int pwdUtility(struct interpreter *shell, char **args, int argCount);
+int sleepUtility(struct interpreter *shell, char **args, int argCount);
+int catUtility(struct interpreter *shell, char **args, int argCount);
+int testUtility(struct interpreter *shell, char **args, int argCount);
+
+/* env.c */
+void initEnv(struct environment *env, char **from, int isEnviron,
+        struct nameSet *names);
+int exportVar(struct environment *env, const char *id, const char *value);
+int unexportVar(struct environment *env, const char *id);
+char *findEnvVar(struct environment *env, const char *id);
+void freeEnv(struct environment *env);
+
+/* log.c */
+extern int logLevel;
+void initLog(int level);
+void logMessage(const char *format, ...)
+        __attribute__((format(printf, 1, 2)));
+void flushLog();
+
+/* jobs.c */
+void initJobs(int interactive);
+void initJobTable(struct jobTable *jobs, int byPid);
+void resetChildSignals();
+struct job *newJob();
+void addJob(struct jobTable *jobs, struct job *job);
+void removeJob(struct jobTable *jobs, struct job *job);
+void freeJobs(struct jobTable *jobs);
+struct job *nextJob(struct jobTable *jobs, struct job *job);
+struct job *findJob(struct jobTable *jobs, int id);
+struct job *findJobByPid(struct jobTable *jobs, pid_t pid);
+void signalJob(struct job *job, int sig);
+int handleEvents(struct jobTable *jobs, int block);
+void waitForInput(struct jobTable *jobs, int fd);
+int pauseShell(struct jobTable *jobs, double seconds);
+int signalEventFd();
+void waitForJob(struct jobTable *jobs, struct job *job);
+void waitForAnyJob(struct jobTable *jobs);
+struct job *currentJob(struct jobTable *jobs);
+void listJobs(struct jobTable *jobs, FILE *out);
+void printJob(FILE *out, struct job *job);
+void reportJobs(struct jobTable *jobs, int verbose);
+void addUsage(struct rusage *total, struct rusage *usage);
+
+/* zygote.c */
+int startZygote();
+pid_t spawnWithZygote(char *path, struct spawnRequest *request);
+
+/* functions.c */
+void defineFunction(struct interpreter *shell, char *name,
+        struct command *body, struct program *program);
+struct function *findFunction(struct interpreter *shell, char *name);
+void freeFunctions(struct interpreter *shell);
+
+/* tokenize.c */
+int tokenizeLine(const char *line, size_t length, struct token *tokens,
+        int max);
+int useTokenizer(int kind);
+int currentTokenizer();
+
+/* serve.c */
+void serveClients(char *path, struct serveRequest *request);
+int runClient(char *path, char *script, int numArgs, char **args);
+
+/* metrics.c */
+extern __thread struct metrics metrics;
+void addMetrics(struct metrics *total);
+void countSpawn(int started, double seconds);
+void countInput(char *path);
+void countOutput(char *path, off_t start);
+off_t fileSize(char *path);
+void writeMetrics(FILE *out);
+void dumpMetrics();
+void initMetrics(char *path, int interval);
+int metricsTimeout();
+void checkMetrics();
+
+/* trace.c */
+extern int tracing;
+int initTrace(char *path);
+double traceNow();
+void traceSpan(const char *category, const char *name, double start,
+        pid_t tid, int status);
+void traceJob(struct job *job);
+void traceThread(const char *name);
+void flushTrace();
+
+/* parse.c */
+int lookupBuiltin(char *name);
+struct command *parseLine(struct arena *arena, char *line, int lineNumber);
+void initBlockParser(struct blockParser *parser);
+int addCommand(struct blockParser *parser, struct arena *arena,
+        struct command *command);
+void closeBlocks(struct blockParser *parser, struct arena *arena);
+void parallelProgram(struct program *program, char *jobs);
+struct program *loadScript(char *path, char *cachePath);
+struct program *sourceScript(char *path);
+struct program *copyBlock(struct command *body);
+void retainProgram(struct program *program);
+void freeProgram(struct program *program);
+
 #endif /* _XSSH_H */
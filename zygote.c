@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "xssh.h"
+
+// fds that come with each request: the cwd, stdin, stdout and stderr
+#define ZYGOTE_FDS 4
+
+/*
+ * What the shell sends for each program: this header, then length
+ * bytes of NUL terminated strings (the path, the args, the environment,
+ * then the < and > files if there are any). The fds come along with
+ * the header as SCM_RIGHTS.
+ */
+struct zygoteHeader {
+    unsigned int argCount;
+    unsigned int envCount;
+    unsigned int length;
+    int background;
+    pid_t pgid;
+    int hasFileIn;
+    int hasFileOut;
+};
+
+/*
+ * What the zygote answers. pid is the shell's child even if it failed,
+ * error is its errno then.
+ */
+struct zygoteReply {
+    pid_t pid;
+    int error;
+};
+
+// The shell's end of the socketpair, -1 when there is no zygote
+static int zygoteFd = -1;
+
+// -P scripts take turns on the one socket
+static pthread_mutex_t zygoteLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * Receives exactly length bytes, -1 on an error or early EOF
+ */
+static int receiveAll(int fd, void *buffer, size_t length) {
+    size_t done = 0;
+
+    while(done < length) {
+        ssize_t count = recv(fd, (char *) buffer + done, length - done,
+                MSG_WAITALL);
+
+        if(count == -1 && errno == EINTR) {
+            continue;
+        }
+        if(count <= 0) {
+            return -1;
+        }
+        done += count;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * In the zygote: starts one program. The clone has the shell as its
+ * parent, so the shell waits on it and gets its SIGCHLD like for any
+ * other spawn method. A close-on-exec pipe tells whether exec worked.
+ */
+static void startRequest(int fd, struct zygoteHeader *header, int *fds,
+        char *strings) {
+    struct spawnRequest request;
+    struct zygoteReply reply;
+    char *path, *next;
+    int report[2];
+    unsigned int i;
+
+    request.args = (char **) malloc(sizeof(char *)
+            * (header->argCount + header->envCount + 2));
+    request.env = request.args + header->argCount + 1;
+
+    path = strings;
+    next = path + strlen(path) + 1;
+    for(i = 0; i < header->argCount; ++i) {
+        request.args[i] = next;
+        next += strlen(next) + 1;
+    }
+    request.args[header->argCount] = NULL;
+    for(i = 0; i < header->envCount; ++i) {
+        request.env[i] = next;
+        next += strlen(next) + 1;
+    }
+    request.env[header->envCount] = NULL;
+
+    request.argCount = header->argCount;
+    request.fileIn = NULL;
+    request.fileOut = NULL;
+    if(header->hasFileIn) {
+        request.fileIn = next;
+        next += strlen(next) + 1;
+    }
+    if(header->hasFileOut) {
+        request.fileOut = next;
+    }
+    request.inFd = fds[1];
+    request.outFd = fds[2];
+    request.background = header->background;
+    request.pgid = header->pgid;
+    request.cwd = AT_FDCWD;         /* it came as fds[0] */
+
+    reply.error = 0;
+    if(pipe2(report, O_CLOEXEC) == -1) {
+        reply.pid = -1;
+        reply.error = errno;
+    } else {
+        reply.pid = (pid_t) syscall(SYS_clone, CLONE_PARENT | SIGCHLD,
+                NULL, NULL, NULL, NULL);
+
+        if(reply.pid == 0) {
+            int error;
+
+            close(report[0]);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            dup2(fds[3], 2);
+            if(fchdir(fds[0]) == 0 && setupChildFds(&request) == 0) {
+                execve(path, request.args, request.env);
+            }
+
+            error = errno;
+            write(report[1], &error, sizeof(error));
+            _exit(127);
+        }
+
+        close(report[1]);
+        if(reply.pid == -1) {
+            reply.error = errno;
+        } else {
+            while(read(report[0], &reply.error, sizeof(reply.error)) == -1
+                    && errno == EINTR) {
+            }
+        }
+        close(report[0]);
+    }
+
+    for(i = 0; i < ZYGOTE_FDS; ++i) {
+        close(fds[i]);
+    }
+    free(request.args);
+
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+
+
+/*
+ * The zygote's loop, until the shell closes its end
+ */
+static void runZygote(int fd) {
+    while(1) {
+        struct zygoteHeader header;
+        char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+        struct iovec part = {&header, sizeof(header)};
+        struct msghdr message;
+        struct cmsghdr *fds;
+        char *strings;
+        ssize_t count;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        do {
+            count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+        } while(count == -1 && errno == EINTR);
+
+        fds = CMSG_FIRSTHDR(&message);
+        if(count != sizeof(header) || fds == NULL
+                || fds->cmsg_type != SCM_RIGHTS
+                || fds->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+            _exit(0);
+        }
+
+        strings = (char *) malloc(header.length + 1);
+        if(receiveAll(fd, strings, header.length) == -1) {
+            _exit(0);
+        }
+        strings[header.length] = 0;
+
+        startRequest(fd, &header, (int *) CMSG_DATA(fds), strings);
+        free(strings);
+    }
+}
+
+
+
+/*
+ * Forks the zygote. It should happen early, while the shell is small:
+ * the zygote stays that size however big the shell gets.
+ * Returns -1 with errno set if it couldn't be started.
+ */
+int startZygote() {
+    int ends[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) == -1) {
+        return -1;
+    }
+
+    fflush(stdout);
+    flushLog();
+
+    pid = fork();
+    if(pid == -1) {
+        close(ends[0]);
+        close(ends[1]);
+        return -1;
+    }
+
+    if(pid == 0) {
+        // Ctrl-C and Ctrl-Z are for the shell's jobs, and the zygote
+        // goes when the shell does
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+        close(ends[0]);
+        runZygote(ends[1]);
+        _exit(0);
+    }
+
+    close(ends[1]);
+    zygoteFd = ends[0];
+    LOG(LOG_DEBUG, "zygote %d started\n", pid);
+
+    return 0;
+}
+
+
+
+/*
+ * Sends one request and reads the answer, with zygoteLock held.
+ * Returns -1 with errno set if the zygote is gone.
+ */
+static int askZygote(struct zygoteHeader *header, int *sendFds,
+        char *strings, struct zygoteReply *reply) {
+    char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct iovec parts[2];
+    struct msghdr message;
+    struct cmsghdr *fds;
+    size_t length = sizeof(*header) + header->length;
+    ssize_t sent;
+
+    parts[0].iov_base = header;
+    parts[0].iov_len = sizeof(*header);
+    parts[1].iov_base = strings;
+    parts[1].iov_len = header->length;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    fds = CMSG_FIRSTHDR(&message);
+    fds->cmsg_level = SOL_SOCKET;
+    fds->cmsg_type = SCM_RIGHTS;
+    fds->cmsg_len = CMSG_LEN(ZYGOTE_FDS * sizeof(int));
+    memcpy(CMSG_DATA(fds), sendFds, ZYGOTE_FDS * sizeof(int));
+
+    do {
+        sent = sendmsg(zygoteFd, &message, MSG_NOSIGNAL);
+    } while(sent == -1 && errno == EINTR);
+
+    if(sent == -1) {
+        return -1;
+    }
+
+    // Large environments may not go in one piece, the rest follows
+    while((size_t) sent < length) {
+        ssize_t count = send(zygoteFd, strings + (sent - sizeof(*header)),
+                length - sent, MSG_NOSIGNAL);
+
+        if(count == -1 && errno == EINTR) {
+            continue;
+        }
+        if(count == -1) {
+            return -1;
+        }
+        sent += count;
+    }
+
+    if(receiveAll(zygoteFd, reply, sizeof(*reply)) == -1) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Has the zygote start path with the request's args, environment,
+ * pipes, redirections and process group, in the shell's cwd.
+ * Returns the child PID, or -1 with errno set if it couldn't exec.
+ */
+pid_t spawnWithZygote(char *path, struct spawnRequest *request) {
+    struct zygoteHeader header;
+    struct zygoteReply reply;
+    char *strings, *next;
+    size_t length = strlen(path) + 1;
+    int fds[ZYGOTE_FDS];
+    int i, result;
+
+    if(zygoteFd == -1) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    header.argCount = request->argCount;
+    header.envCount = 0;
+    header.background = request->background;
+    header.pgid = request->pgid;
+    header.hasFileIn = (request->fileIn != NULL);
+    header.hasFileOut = (request->fileOut != NULL);
+
+    for(i = 0; i < request->argCount; ++i) {
+        length += strlen(request->args[i]) + 1;
+    }
+    for(i = 0; request->env[i] != NULL; ++i) {
+        length += strlen(request->env[i]) + 1;
+        ++header.envCount;
+    }
+    if(header.hasFileIn) {
+        length += strlen(request->fileIn) + 1;
+    }
+    if(header.hasFileOut) {
+        length += strlen(request->fileOut) + 1;
+    }
+
+    strings = (char *) malloc(length);
+    next = stpcpy(strings, path) + 1;
+    for(i = 0; i < request->argCount; ++i) {
+        next = stpcpy(next, request->args[i]) + 1;
+    }
+    for(i = 0; request->env[i] != NULL; ++i) {
+        next = stpcpy(next, request->env[i]) + 1;
+    }
+    if(header.hasFileIn) {
+        next = stpcpy(next, request->fileIn) + 1;
+    }
+    if(header.hasFileOut) {
+        next = stpcpy(next, request->fileOut) + 1;
+    }
+    header.length = next - strings;
+
+    // A -P script's own directory, or the shell's
+    fds[0] = (request->cwd != AT_FDCWD ? request->cwd
+            : open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(fds[0] == -1) {
+        free(strings);
+        return -1;
+    }
+    fds[1] = (request->inFd != -1 ? request->inFd : 0);
+    fds[2] = (request->outFd != -1 ? request->outFd : 1);
+    fds[3] = 2;
+
+    pthread_mutex_lock(&zygoteLock);
+    result = askZygote(&header, fds, strings, &reply);
+    pthread_mutex_unlock(&zygoteLock);
+
+    if(fds[0] != request->cwd) {
+        close(fds[0]);
+    }
+    free(strings);
+
+    if(result == -1) {
+        return -1;
+    }
+
+    if(reply.error != 0) {
+        // It's our child either way, don't leave a zombie behind
+        if(reply.pid > 0) {
+            waitpid(reply.pid, NULL, 0);
+        }
+        errno = reply.error;
+        return -1;
+    }
+
+    return reply.pid;
+}